@@ -0,0 +1,51 @@
+#! /usr/bin/env bash
+
+# gen-bench.sh words seed board_file dict_file
+# writes a random 4-sided board with 3 letters per side, and a dictionary of
+# the given number of words: up to 2000 walks over the board (so there is
+# something to solve, but not more as the dictionary grows), the others
+# random lowercase words.
+
+if (( $# != 4 )); then
+    echo "usage: gen-bench.sh <words> <seed> <board_file> <dict_file>"
+    exit 1
+fi
+
+awk -v words=$1 -v seed=$2 -v board_file=$3 -v dict_file=$4 '
+BEGIN {
+    srand(seed)
+    alphabet = "abcdefghijklmnopqrstuvwxyz"
+    for (i = 1; i <= 26; i++) {
+        letters[i] = substr(alphabet, i, 1)
+    }
+    # shuffle the alphabet, the first 12 letters make the board
+    for (i = 26; i > 1; i--) {
+        j = int(rand() * i) + 1
+        t = letters[i]; letters[i] = letters[j]; letters[j] = t
+    }
+    for (s = 0; s < 4; s++) {
+        side[s] = letters[3 * s + 1] letters[3 * s + 2] letters[3 * s + 3]
+        print side[s] > board_file
+    }
+
+    for (w = 0; w < words; w++) {
+        word = ""
+        if (w % 100 == 0 && w < 200000) {
+            length_ = 3 + int(rand() * 6)
+            s = int(rand() * 4)
+            for (k = 0; k < length_; k++) {
+                if (k > 0) {
+                    next_ = int(rand() * 3)
+                    s = next_ >= s ? next_ + 1 : next_  # any side but the previous one
+                }
+                word = word substr(side[s], int(rand() * 3) + 1, 1)
+            }
+        } else {
+            length_ = 3 + int(rand() * 10)
+            for (k = 0; k < length_; k++) {
+                word = word substr(alphabet, int(rand() * 26) + 1, 1)
+            }
+        }
+        print word > dict_file
+    }
+}'
@@ -0,0 +1,41 @@
+#! /usr/bin/env bash
+
+# run-bench.sh [words ...]
+# for every dictionary size (default: 10k, 100k, 1M and 5M words), generates a
+# board and dictionary with gen-bench.sh and times letter-boxed on them:
+# - --bench: loading, lookups, rule checks, validation and solving on the board
+# - --batch: loading and indexing the whole dictionary, then checking a correct
+#   solution CASES times against it
+# Generated files are kept in bench-out/ and reused by later runs.
+
+BIN=../solution/letter-boxed
+OUT=bench-out
+SEED=537
+CASES=20000
+
+sizes=("$@")
+if (( ${#sizes[@]} == 0 )); then
+    sizes=(10000 100000 1000000 5000000)
+fi
+
+if [[ ! -x $BIN ]]; then
+    echo "$BIN not found, build it first"
+    exit 1
+fi
+mkdir -p $OUT
+
+for words in "${sizes[@]}"; do
+    board=$OUT/$words.board
+    dict=$OUT/$words.dict
+    if [[ ! -f $dict ]]; then
+	./gen-bench.sh $words $SEED $board $dict || exit 1
+    fi
+
+    echo "== $words words"
+    $BIN --bench $board $dict || exit 1
+
+    # one of the shortest solutions, checked over and over in batch mode
+    $BIN --solve $board $dict | head -n 1 | tr ' ' '\n' > $OUT/$words.solution
+    yes "$board $OUT/$words.solution" | head -n $CASES > $OUT/$words.manifest
+    $BIN --stats --batch $dict $OUT/$words.manifest 2>&1 > /dev/null
+done
@@ -17,11 +17,37 @@ Date:9/13/2024          Commit Message:"Passed all tests."
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 
 #define BOARD_SIZE 50 // seems to be at most 4, but for flexibility we take 5
-#define DICT_CAPACITY 1000
+#define ARENA_BLOCK_SIZE 4096 // smallest block an arena allocates
 #define NUM_LET 26
-#define SOLUTION_CAPACITY 1000
+#define EMPTY_SLOT 0xffffffffu // marks an unused slot in dict_index
+#define OTHER_CHAR_BIT (1u << NUM_LET) // set in a word mask when the word has a character outside a-z
+#define DICT_IMAGE_MAGIC "LBDICT\0\0"
+#define DICT_IMAGE_VERSION 1u // also catches images written with the other byte order
+#define NO_SIDE 0xff // letter_side[] of a character that is not on the board
+#define START_SIDE 0xfe // side "before" the first letter of a word, never equal to a real side
+#define OFF_BOARD 1 // word_side_flags(): the word uses a letter not on the board
+#define SAME_SIDE 2 // word_side_flags(): the word uses two letters of one side consecutively
+#define WORD_AT_A_TIME_MIN 16 // words at least this long are checked 8 letters at a time
+#define BATCH_CHUNK 4096 // manifest lines checked per round of batch workers
+#define BOARD_CACHE_SIZE 64 // boards kept loaded by the server
+#define MAX_REQUEST_LENGTH (1 << 20) // longest request line the server accepts
+#define HAS_ZERO_BYTE(v) (((v) - 0x0101010101010101ull) & ~(v) & 0x8080808080808080ull)
 
 // Rules:
 // 1. use each letter in the board at least ONCE.
@@ -30,82 +56,463 @@ Date:9/13/2024          Commit Message:"Passed all tests."
 // 4. NOT use letters beyond the board.
 // 5. only one occurrence of a letter on the board.
 
+// outcome of checking a solution (or a batch case), index into result_messages
+enum {
+	RESULT_CORRECT,
+	RESULT_OFF_BOARD,
+	RESULT_NOT_IN_DICT,
+	RESULT_SAME_SIDE,
+	RESULT_NO_MATCH,
+	RESULT_NOT_ALL_USED,
+	RESULT_INVALID_BOARD,
+	RESULT_OPEN_BOARD_FAILED,
+	RESULT_OPEN_SOLUTION_FAILED,
+	RESULT_BAD_CASE,
+	RESULT_NOT_CHECKED,
+	RESULT_BAD_REQUEST,
+	RESULT_SERVER_BUSY,
+	RESULT_SOLVE_FAILED,
+};
+
+const char* result_messages[] = {
+	"Correct",
+	"Used a letter not present on the board",
+	"Word not found in dictionary",
+	"Same-side letter used consecutively",
+	"First letter of word does not match last letter of previous word",
+	"Not all letters used",
+	"Invalid board",
+	"open board failed",
+	"open solution failed",
+	"Invalid manifest line",
+	"Not checked",
+	"Invalid request",
+	"Server busy",
+	"Solve failed",
+};
+
+// memory handed out in order by arena_alloc() and given back all at once by arena_free()
+typedef struct arena_block {
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+	_Alignas(16) char data[];
+} arena_block;
+
+typedef struct {
+	arena_block* head; // the block being filled, the full ones follow
+} arena;
+
+// a solution being checked word by word, in one pass and constant memory
+typedef struct {
+	int result; // the most important rule broken so far (lowest RESULT_*), RESULT_CORRECT if none
+	int words;
+	char last; // last letter of the previous word
+	unsigned int used_mask; // letter mask of all words so far
+	int lookups;
+	double lookup_ms; // time spent in is_in_dict()
+} solution_check;
+
+// a dictionary word, stored in place as a slice of dict_data (not NUL-terminated)
+typedef struct {
+	unsigned int offset;
+	unsigned int length;
+} dict_word;
+
+// header of a compiled dictionary image (--compile-dict). The sections follow it
+// in this order, in native byte order, each 4-byte aligned:
+//   dict_word words[word_count]     sorted, offsets into the string table
+//   unsigned int masks[word_count]  letter mask of each word
+//   unsigned int index[index_slots] the dict_index hash set
+//   char strings[strings_size]      the words, sorted and separated by '\n'
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int word_count;
+	unsigned int index_slots;
+	unsigned int words_offset;
+	unsigned int masks_offset;
+	unsigned int index_offset;
+	unsigned int strings_offset;
+	unsigned int strings_size;
+} dict_image_header;
+
+// candidate words that are interchangeable for the solver: same first letter, last letter
+// and letter mask. Its words are class_words[start .. start + count).
+typedef struct {
+	unsigned int mask;
+	int first;
+	int last;
+	int start;
+	int count;
+} word_class;
+
+// solver search state: the letters covered so far and the last letter of the chain
+typedef struct {
+	unsigned int mask;
+	int last;
+	int depth; // number of words in the shortest chains reaching this state
+	int first_edge; // edges of those chains into this state, -1 terminated
+} solver_state;
+
+// a thread of the parallel solver. It owns the start classes next_task .. end_task - 1
+// and remembers, per (mask, last letter), how many more words were tried without success.
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock; // protects the updates of next_task and end_task, which other workers steal from
+	atomic_int next_task; // atomic because other workers read it without the lock, as a hint
+	atomic_int end_task;
+	int steals;
+	unsigned int* dead_keys; // open-addressing map (mask, last letter) -> dead_budgets
+	unsigned char* dead_budgets;
+	unsigned int dead_mask;
+	int dead_size;
+	int chain[NUM_LET + 1];
+} solver_worker;
+
+// the last step of a shortest chain into a state: parent state (-1 at the start) plus a word class
+typedef struct {
+	int parent;
+	int word_class;
+	int next;
+} solver_edge;
+
+// a board kept loaded by the server, along with everything needed to switch to it
+typedef struct {
+	char* name; // board file name, NULL if the slot is unused
+	char** sides;
+	int num_sides;
+	arena storage; // the sides
+	unsigned int mask;
+	unsigned char letter_side[256];
+	struct timespec mtime; // of the board file when it was loaded, a change loads it again
+	off_t size;
+	char* solutions; // answer to "solve", NULL until it is asked for once
+	size_t solutions_size;
+	size_t solutions_capacity;
+	pid_t solver_pid; // child solving the board, its output is read from solver_fd; 0 if none
+	int solver_fd;
+} cached_board;
+
+// a connection to the server. Requests are read into in until a whole line is there,
+// responses are queued in out until the socket takes them.
+typedef struct {
+	int fd;
+	int closing; // the client will not send more, close once out is sent
+	cached_board* waiting; // board whose solve answers its current request, its later requests wait
+	char* in;
+	size_t in_size;
+	size_t in_capacity;
+	char* out;
+	size_t out_size;
+	size_t out_sent;
+	size_t out_capacity;
+} server_client;
+
 // global variable
 char** board; // we use ptr of ptr (a 2d array) to load the board.txt;
 // board[i] represent which side of the board (at most 4), board[i][j] represents the letter
 int num_sides;
-char** dict;
+arena board_arena; // board and its sides, freed by free_board()
+void* dict_map; // the whole dictionary file, mapped read-only (or read into one buffer)
+size_t dict_map_size;
+int dict_mapped; // 1 if dict_map came from mmap, 0 if it was read into a malloc'd buffer
+int dict_from_image; // 1 if dict, dict_masks and dict_index point into a compiled image in dict_map
+const char* dict_data; // the text the words in dict are slices of
+size_t dict_data_size;
+dict_word* dict;
+unsigned int* dict_masks; // dict_masks[i]: bit (c - 'a') set for every letter c of word i
 int dict_size;
-int dict_capacity = DICT_CAPACITY;
+int dict_words_read; // words in the dictionary file, dict_size of them are kept
+unsigned int* dict_index; // open-addressing hash set of positions in dict, EMPTY_SLOT if unused
+unsigned int dict_index_mask; // number of slots - 1 (number of slots is a power of two)
+arena dict_arena; // dict, dict_masks and dict_index of a text dictionary, freed by free_dict()
+int show_stats = 0; // --stats: report dictionary load time and lookup latency on stderr
 int letters_counter_board[NUM_LET] = {0};
-char** solution;
-int solution_size;
-int solution_capacity = SOLUTION_CAPACITY;
-int letters_counter_solution[NUM_LET] = {0};
+unsigned int board_mask; // letter mask of the whole board, 0 until a board is read
+unsigned char letter_side[256]; // side of each character on the board, NO_SIDE if it is not on the board
+int* candidates; // positions in dict of the words that can be played on this board
+int num_candidates;
+word_class* word_classes;
+int num_classes;
+int class_start[NUM_LET + 1]; // classes starting with letter c are class_start[c] .. class_start[c + 1] - 1
+int max_class_letters; // most letters covered by one word class
+int* class_words; // candidates grouped by word class
+solver_state* states;
+int num_states;
+int states_capacity;
+solver_edge* edges;
+int num_edges;
+int edges_capacity;
+int* state_table; // open-addressing map from (mask, last letter) to a state, -1 if unused
+unsigned int state_table_mask;
+solver_worker* workers;
+int num_workers;
+atomic_int best_depth; // parallel solver: fewest words in any solution found so far
+pthread_mutex_t found_lock = PTHREAD_MUTEX_INITIALIZER; // protects found_chains and num_found
+int* found_chains; // parallel solver: solutions, NUM_LET + 1 word classes each, chain length first
+int num_found;
+int found_capacity;
+FILE* solution_output; // where the solvers print solutions, stdout unless the server collects them
+cached_board board_cache[BOARD_CACHE_SIZE];
+int board_cache_next; // slot that is replaced next once the cache is full
+volatile sig_atomic_t server_running;
+long server_requests; // answered by the server, for --stats
+double server_request_ms;
 
 // define function prototypes
+void* arena_alloc(arena* a, size_t size);
+void arena_free(arena* a);
 void read_board(const char* fileName);
+int load_board(const char* fileName);
+void free_board(void);
 void read_dict(const char* fileName);
-void read_solution(void);
+void load_dict_image(void);
+void compile_dict(const char* dictFileName, const char* imageFileName);
+void free_dict(void);
+int check_word(solution_check* check, const char* word, size_t length);
+int check_solution(FILE* input, solution_check* check);
+int finish_check(solution_check* check);
+unsigned int word_mask(const char *word, size_t length);
+int word_side_flags(const char *word, size_t length);
+void filter_dict(void);
+unsigned int hash_word(const char *word, size_t length);
+void build_dict_index(void);
 int is_in_dict(const char* word);
-int prev_match_curr(const char *prev, const char *curr);
 int is_same_side_consecutive(const char *word);
 int is_on_board(const char *word);
+int is_same_side_consecutive_scan(const char *word);
+int is_on_board_scan(const char *word);
+void bench_rules(void);
+void bench_dict(double load_ms);
+void bench_all(void);
 void test_solution(void);
+int check_case(char* line);
+void run_batch(FILE* manifest, int jobs);
+void run_server(const char* socketPath, int threads);
+void stop_server(int sig);
+int run_client(const char* socketPath);
+int cache_board(const char* fileName, cached_board** entry);
+void use_board(const cached_board* entry);
+void serve_lines(server_client* client, int threads);
+void serve_request(server_client* client, char* line, int threads);
+void start_solve(cached_board* entry, int threads);
+void finish_solve(cached_board* entry, server_client* clients, int num_clients, int threads);
+void drop_cached_board(cached_board* entry);
+void queue_response(server_client* client, const char* data, size_t size);
+void build_word_classes(void);
+int get_state(unsigned int mask, int last, int depth);
+void add_edge(int state, int parent, int word_class);
+long solve(void);
+void collect_chains(int state, int *chain, int length, int depth);
+long print_words(const int *chain, int length, int pos, char *line, size_t line_length);
+void free_solver(void);
+long solve_parallel(int threads);
+void* solver_thread(void *arg);
+int take_task(solver_worker *worker);
+int solve_from(solver_worker *worker, unsigned int mask, int last, int depth);
+void record_chain(const int *chain, int length);
+double now_ms(void);
 
 
 int main(int argc, char* argv[]){
-	printf("hello world");
+	if(argc == 4 && strcmp(argv[1], "--compile-dict") == 0){
+		compile_dict(argv[2], argv[3]);
+		return 0;
+	}
+	if(argc == 3 && strcmp(argv[1], "--client") == 0){
+		return run_client(argv[2]);
+	}
+
+	solution_output = stdout;
+	int arg = 1;
+	int run_bench = 0;
+	int run_solve = 0;
+	int threads = 0; // --threads: solve in parallel with this many threads
+	int run_batch_mode = 0;
+	int run_server_mode = 0;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN); // --jobs: batch worker processes
+	for(; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++){
+		if(strcmp(argv[arg], "--stats") == 0){
+			show_stats = 1;
+		}else if(strcmp(argv[arg], "--bench") == 0){
+			run_bench = 1;
+		}else if(strcmp(argv[arg], "--solve") == 0){
+			run_solve = 1;
+		}else if(strcmp(argv[arg], "--batch") == 0){
+			run_batch_mode = 1;
+		}else if(strcmp(argv[arg], "--serve") == 0){
+			run_server_mode = 1;
+		}else if(strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc){
+			jobs = atoi(argv[++arg]);
+			if(jobs <= 0){
+				jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			}
+		}else if(strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc){
+			run_solve = 1;
+			threads = atoi(argv[++arg]);
+			if(threads <= 0){
+				threads = sysconf(_SC_NPROCESSORS_ONLN);
+			}
+		}else{
+			break; // unknown option
+		}
+	}
+
 	// initial check for the correct number of args
-    if(argc != 3){
-        printf("Usage: %s <board_file_name> <dict_file_name>\n", argv[0]);
-		//printf("HI whats up");
+	int num_args = run_batch_mode ? (argc - arg == 1 || argc - arg == 2) : argc - arg == 2;
+    if(!num_args || strncmp(argv[arg], "--", 2) == 0){
+        printf("Usage: %s [--stats] [--bench | --solve [--threads n]] <board_file_name> <dict_file_name>\n", argv[0]);
+        printf("       %s [--stats] [--jobs n] --batch <dict_file_name> [manifest_file_name]\n", argv[0]);
+        printf("       %s [--stats] [--threads n] --serve <socket_file_name> <dict_file_name>\n", argv[0]);
+        printf("       %s --compile-dict <dict_file_name> <image_file_name>\n", argv[0]);
+        printf("       %s --client <socket_file_name>\n", argv[0]);
         return 1;
     }
 
-	printf("Start from main!");
+	// server mode: load the dictionary once, then answer requests until stopped
+	if(run_server_mode){
+		double start = now_ms();
+		read_dict(argv[arg + 1]);
+		if(show_stats){
+			fprintf(stderr, "dict: %d words loaded and indexed in %.3f ms\n", dict_size, now_ms() - start);
+		}
+		run_server(argv[arg], threads);
+		free_dict();
+		return 0;
+	}
 
-	// read the board and dict file
-	read_board(argv[1]);
-	printf("I have passed read_board.");
-	read_dict(argv[2]);
-	printf("I have passed read_dict");
+	// batch mode: load the dictionary once, then check every case of the manifest against it
+	if(run_batch_mode){
+		FILE *manifest = stdin;
+		if(argc - arg == 2 && !(manifest = fopen(argv[arg + 1], "r"))){
+			printf("open manifest failed\n");
+			return 1;
+		}
+		double start = now_ms();
+		read_dict(argv[arg]);
+		if(show_stats){
+			fprintf(stderr, "dict: %d words loaded and indexed in %.3f ms\n", dict_size, now_ms() - start);
+		}
+		run_batch(manifest, jobs);
+		if(manifest != stdin){
+			fclose(manifest);
+		}
+		free_dict();
+		return 0;
+	}
 
-	test_solution();
+	// --bench: loading and lookups are timed on the whole dictionary, before the board
+	// lets read_dict() drop words
+	if(run_bench){
+		double start = now_ms();
+		read_dict(argv[arg + 1]);
+		bench_dict(now_ms() - start);
+		free_dict();
+	}
+
+	// read the board and dict file
+	read_board(argv[arg]);
 
-	for(int i = 0; i < num_sides; i++){
-		free(board[i]);
+	double start = now_ms();
+	read_dict(argv[arg + 1]);
+	filter_dict();
+	if(show_stats){
+		fprintf(stderr, "dict: %d words loaded, %d kept and indexed in %.3f ms, %d playable on this board\n",
+				dict_words_read, dict_size, now_ms() - start, num_candidates);
 	}
-	free(board);
 
-	for(int i = 0; i < dict_size; i++){
-		free(dict[i]);
+	if(run_bench){
+		bench_all();
+		return 0;
 	}
-	free(dict);
 
-	for(int i = 0; i < solution_size; i++){
-		free(solution[i]);
+	if(run_solve){
+		start = now_ms();
+		build_word_classes();
+		long found = threads > 0 ? solve_parallel(threads) : solve();
+		if(found == 0){
+			printf("No solution\n");
+		}
+		if(show_stats && num_workers > 0){
+			int steals = 0;
+			for(int i = 0; i < num_workers; i++){
+				steals += workers[i].steals;
+			}
+			fprintf(stderr, "solve: %ld solutions, %d word classes, %d threads, %d steals in %.3f ms\n",
+					found, num_classes, num_workers, steals, now_ms() - start);
+		}else if(show_stats){
+			fprintf(stderr, "solve: %ld solutions, %d word classes, %d states, %d edges in %.3f ms\n",
+					found, num_classes, num_states, num_edges, now_ms() - start);
+		}
+		free_solver();
+		free_dict();
+		free(candidates);
+		return 0;
 	}
-	free(solution);
+
+	test_solution();
+
+	free_board();
+	free_dict();
+	free(candidates);
 
     return 0;
 }
 
+// size bytes from the arena, 16-byte aligned. A request that does not fit into the current
+// block starts a new one, at least ARENA_BLOCK_SIZE big, so big arrays get a block of their own.
+void* arena_alloc(arena* a, size_t size){
+	arena_block *block = a->head;
+	size_t start = block ? (block->used + 15) & ~(size_t)15 : 0;
+	if(!block || start + size > block->size){
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(arena_block) + block_size);
+		if(!block){
+			printf("Failed to allocate memory for arena.\n");
+			exit(1);
+		}
+		block->next = a->head;
+		block->size = block_size;
+		a->head = block;
+		start = 0;
+	}
+	block->used = start + size;
+	return block->data + start;
+}
+
+// give back everything allocated from the arena
+void arena_free(arena* a){
+	arena_block *block = a->head;
+	while(block){
+		arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	a->head = NULL;
+}
+
 void read_board(const char* fileName){
-	// init, NEED TO free later
-	num_sides = 0;
-	board = malloc(sizeof(char*) * BOARD_SIZE);
-	if(!board){
-		printf("Failed to allocate memory for board\n");
+	int result = load_board(fileName);
+	if(result != RESULT_CORRECT){
+		printf("%s\n", result_messages[result]);
 		exit(1);
 	}
+}
+
+// read a board into the board globals; RESULT_CORRECT, or why the board cannot be used
+int load_board(const char* fileName){
+	// init, NEED TO free later
+	num_sides = 0;
+	board_mask = 0;
+	memset(letters_counter_board, 0, sizeof(letters_counter_board));
+	memset(letter_side, NO_SIDE, sizeof(letter_side));
+	board = arena_alloc(&board_arena, sizeof(char*) * BOARD_SIZE);
 
 	// read file
 	FILE *file = fopen(fileName,"r");
 	if(!file){
-		printf("open board failed\n");
-		//printf(" ");
-		exit(1);
+		return RESULT_OPEN_BOARD_FAILED;
 	}
 	char *line = NULL;
 	size_t len = 0;
@@ -113,16 +520,18 @@ void read_board(const char* fileName){
 
 	while ((nread = getline(&line, &len, file)) != -1){
 		line[strcspn(line, "\n")] = 0;
-		
-		size_t line_length = strlen(line) + 1;
 
-		board[num_sides] = malloc(sizeof(char) * line_length);//or just line_length?
-		if(!board[num_sides]){
-			printf("Failed to allocate memory for letters.\n");
-			exit(1);
+		// board has room for BOARD_SIZE sides, any file can be named by a request or a manifest
+		if(num_sides == BOARD_SIZE){
+			fclose(file);
+			free(line);
+			return RESULT_INVALID_BOARD;
 		}
+		
+		size_t line_length = strlen(line) + 1;
 
-		strncpy(board[num_sides++], line, line_length);
+		board[num_sides] = arena_alloc(&board_arena, line_length);
+		memcpy(board[num_sides++], line, line_length);
 	}
 
 	fclose(file);
@@ -130,8 +539,7 @@ void read_board(const char* fileName){
 
 	// check the validness of board	
 	if (num_sides < 3) {
-        printf("Invalid board\n");
-        exit(1);
+        return RESULT_INVALID_BOARD;
     }
 
     for (int i = 0; i < num_sides; i++) {
@@ -140,130 +548,385 @@ void read_board(const char* fileName){
             if (letter >= 'a' && letter <= 'z') {
                 int index = letter - 'a';
                 letters_counter_board[index]++;
+                letter_side[(unsigned char)letter] = i;
+                board_mask |= 1u << index;
                 if (letters_counter_board[index] > 1) {
-                    printf("Invalid board\n");  // Letter appears more than once across sides
-                    exit(1);
+                    return RESULT_INVALID_BOARD;  // Letter appears more than once across sides
                 }
             } else {
-                printf("Invalid board\n");  // If there is a non-alphabet character
-                exit(1);
+                return RESULT_INVALID_BOARD;  // If there is a non-alphabet character
             }
         }
     }
 
+	return RESULT_CORRECT;
+}
+
+// forget the board, so that another one can be loaded
+void free_board(void){
+	arena_free(&board_arena);
+	board = NULL;
+	num_sides = 0;
+	board_mask = 0;
+	memset(letters_counter_board, 0, sizeof(letters_counter_board));
 }
 
 void read_dict(const char* fileName){
-	// init
-	dict_size = 0;
-	dict = malloc(sizeof(char*) * DICT_CAPACITY);
-	if(!dict){
-		printf("Failed to allocate memory for dict.\n");
+	int fd = open(fileName, O_RDONLY);
+	if(fd < 0){
+		printf("open dictionary failed\n");
 		exit(1);
 	}
 
-	FILE *file = fopen(fileName, "r");
-	if(!file){
-		printf("open dictionary failed\n");
-		exit(1);
+	// map the file and index the words where they lie, no copy per word
+	struct stat st;
+	dict_mapped = 0;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data != MAP_FAILED){
+			dict_map = data;
+			dict_map_size = st.st_size;
+			dict_mapped = 1;
+		}
 	}
 
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t nread;
+	// not mappable (a pipe, an empty file, ...): read it all into one buffer instead
+	if(!dict_mapped){
+		size_t buffer_capacity = 4096;
+		char *buffer = malloc(buffer_capacity);
+		ssize_t nread;
+		dict_map_size = 0;
+		while(buffer && (nread = read(fd, buffer + dict_map_size, buffer_capacity - dict_map_size)) > 0){
+			dict_map_size += nread;
+			if(dict_map_size == buffer_capacity){
+				buffer_capacity *= 2;
+				buffer = realloc(buffer, buffer_capacity);
+			}
+		}
+		if(!buffer){
+			printf("Failed to allocate memory for dictionary file.\n");
+			exit(1);
+		}
+		dict_map = buffer;
+	}
+	close(fd);
 
-	while((nread = getline(&line,&len, file)) != -1){
-		line[strcspn(line, "\n")] = 0;
+	// a compiled image already has everything we need, nothing to parse
+	if(dict_map_size >= sizeof(dict_image_header) && memcmp(dict_map, DICT_IMAGE_MAGIC, 8) == 0){
+		load_dict_image();
+		return;
+	}
 
-		if(dict_size >= dict_capacity){
-			dict_capacity *= 2;
-			dict = realloc(dict, sizeof(char *) * dict_capacity);
-			if(!dict){
-				printf("Failed to reallocate memory to dictionary.\n");
-				exit(1);
-			}
+	dict_from_image = 0;
+	dict_data = dict_map;
+	dict_data_size = dict_map_size;
+	dict_size = 0;
+	dict_words_read = 0;
+
+	// count the lines first, so dict and dict_masks never have to grow
+	size_t lines = 1;
+	const char *end = dict_data + dict_data_size;
+	for(const char *p = dict_data; (p = memchr(p, '\n', end - p)); p++){
+		lines++;
+	}
+	dict = arena_alloc(&dict_arena, sizeof(dict_word) * lines);
+	dict_masks = arena_alloc(&dict_arena, sizeof(unsigned int) * lines);
+
+	size_t pos = 0;
+	while(pos < dict_data_size){
+		const char *newline = memchr(dict_data + pos, '\n', dict_data_size - pos);
+		size_t line_end = newline ? (size_t)(newline - dict_data) : dict_data_size;
+
+		// once the board is known, words with letters off the board can never be part of
+		// a valid solution, and check_word() rejects them before any dictionary lookup
+		unsigned int mask = word_mask(dict_data + pos, line_end - pos);
+		dict_words_read++;
+		if(board_mask == 0 || (mask & ~board_mask) == 0){
+			dict[dict_size].offset = pos;
+			dict[dict_size].length = line_end - pos;
+			dict_masks[dict_size] = mask;
+			dict_size++;
 		}
-		size_t line_length = strlen(line) + 1;
 
-		dict[dict_size] = malloc(line_length);//or just line_length?
-		if(!dict[dict_size]){
-			printf("Failed to allocate memory for words in dictionary.\n");
+		pos = line_end + 1;
+	}
+
+	build_dict_index();
+}
+
+// point dict, dict_masks and dict_index straight into the image in dict_map
+void load_dict_image(void){
+	const dict_image_header *header = dict_map;
+	const char *image = dict_map;
+	size_t words_end = header->words_offset + (size_t)header->word_count * sizeof(dict_word);
+	size_t masks_end = header->masks_offset + (size_t)header->word_count * sizeof(unsigned int);
+	size_t index_end = header->index_offset + (size_t)header->index_slots * sizeof(unsigned int);
+	size_t strings_end = header->strings_offset + (size_t)header->strings_size;
+
+	// the slot count must be a power of two and leave at least one slot empty
+	if(header->version != DICT_IMAGE_VERSION || header->index_slots <= header->word_count ||
+	   (header->index_slots & (header->index_slots - 1)) != 0 ||
+	   words_end > dict_map_size || masks_end > dict_map_size ||
+	   index_end > dict_map_size || strings_end > dict_map_size ||
+	   (header->words_offset | header->masks_offset | header->index_offset) % sizeof(unsigned int) != 0){
+		printf("Invalid dictionary image\n");
+		exit(1);
+	}
+
+	dict_from_image = 1;
+	dict = (dict_word *)(image + header->words_offset);
+	dict_masks = (unsigned int *)(image + header->masks_offset);
+	dict_index = (unsigned int *)(image + header->index_offset);
+	dict_index_mask = header->index_slots - 1;
+	dict_data = image + header->strings_offset;
+	dict_data_size = header->strings_size;
+	dict_size = header->word_count;
+	dict_words_read = dict_size;
+
+	for(int i = 0; i < dict_size; i++){
+		if((size_t)dict[i].offset + dict[i].length > dict_data_size){
+			printf("Invalid dictionary image\n");
 			exit(1);
 		}
+	}
 
-		strncpy(dict[dict_size++], line, line_length);
+	// every slot names a word or is empty, and no more slots are used than there are
+	// words, so a lookup stays inside dict and always reaches an empty slot
+	unsigned int used = 0;
+	for(unsigned int slot = 0; slot < header->index_slots; slot++){
+		if(dict_index[slot] == EMPTY_SLOT){continue;}
+		if(dict_index[slot] >= header->word_count || ++used > header->word_count){
+			printf("Invalid dictionary image\n");
+			exit(1);
+		}
 	}
+}
 
-	fclose(file);
-	free(line);
+// qsort comparator for word positions: byte order, shorter prefix first
+static int compare_dict_words(const void *a, const void *b){
+	const dict_word *word_a = &dict[*(const unsigned int *)a];
+	const dict_word *word_b = &dict[*(const unsigned int *)b];
+	unsigned int common = word_a->length < word_b->length ? word_a->length : word_b->length;
+	int result = memcmp(dict_data + word_a->offset, dict_data + word_b->offset, common);
+	if(result != 0){return result;}
+	return (word_a->length > word_b->length) - (word_a->length < word_b->length);
 }
 
-void read_solution(void){
-	solution_size = 0;
-	solution = malloc(sizeof(char *) * solution_capacity);
-	if(!solution){
-		printf("Failed to allocate memory for solutions.\n");
+// write the text dictionary as an image that read_dict() can use without parsing
+void compile_dict(const char* dictFileName, const char* imageFileName){
+	read_dict(dictFileName);
+	if(dict_from_image){
+		printf("Dictionary is already compiled\n");
 		exit(1);
 	}
 
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t nread;
+	unsigned int *order = malloc(sizeof(unsigned int) * (dict_size + 1));
+	dict_word *words = arena_alloc(&dict_arena, sizeof(dict_word) * (dict_size + 1));
+	unsigned int *masks = arena_alloc(&dict_arena, sizeof(unsigned int) * (dict_size + 1));
+	char *strings = malloc(dict_data_size + 4);
+	if(!order || !strings){
+		printf("Failed to allocate memory for dictionary image.\n");
+		exit(1);
+	}
+	for(int i = 0; i < dict_size; i++){
+		order[i] = i;
+	}
+	qsort(order, dict_size, sizeof(unsigned int), compare_dict_words);
 
-	// read solution
-	while((nread = getline(&line, &len, stdin)) != -1){
-		line[strcspn(line, "\n")] = 0;
+	// sorted string table without duplicates
+	int word_count = 0;
+	size_t strings_size = 0;
+	for(int i = 0; i < dict_size; i++){
+		if(i > 0 && compare_dict_words(&order[i - 1], &order[i]) == 0){continue;}
+		const dict_word *word = &dict[order[i]];
+		words[word_count].offset = strings_size;
+		words[word_count].length = word->length;
+		masks[word_count] = dict_masks[order[i]];
+		memcpy(strings + strings_size, dict_data + word->offset, word->length);
+		strings_size += word->length;
+		strings[strings_size++] = '\n';
+		word_count++;
+	}
 
-		// check if we need to resize solution
-		if(solution_size >= solution_capacity){
-			solution_capacity *= 2;
-			solution = realloc(solution, sizeof(char *) * solution_capacity);
-			if(!solution){
-				printf("Failed to resize solution.\n");
-				free(line);
-				exit(1);
-			}
+	// build the index over the sorted words, exactly as it will be used
+	free(order);
+	dict = words;
+	dict_masks = masks;
+	dict_data = strings;
+	dict_size = word_count;
+	build_dict_index();
+
+	dict_image_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DICT_IMAGE_MAGIC, 8);
+	header.version = DICT_IMAGE_VERSION;
+	header.word_count = word_count;
+	header.index_slots = dict_index_mask + 1;
+	header.words_offset = sizeof(header);
+	header.masks_offset = header.words_offset + word_count * sizeof(dict_word);
+	header.index_offset = header.masks_offset + word_count * sizeof(unsigned int);
+	header.strings_offset = header.index_offset + header.index_slots * sizeof(unsigned int);
+	header.strings_size = strings_size;
+
+	FILE *file = fopen(imageFileName, "w");
+	if(!file){
+		printf("open dictionary image failed\n");
+		exit(1);
+	}
+	if(fwrite(&header, sizeof(header), 1, file) != 1 ||
+	   fwrite(words, sizeof(dict_word), word_count, file) != (size_t)word_count ||
+	   fwrite(masks, sizeof(unsigned int), word_count, file) != (size_t)word_count ||
+	   fwrite(dict_index, sizeof(unsigned int), header.index_slots, file) != header.index_slots ||
+	   fwrite(strings, 1, strings_size, file) != strings_size || fclose(file) != 0){
+		printf("write dictionary image failed\n");
+		exit(1);
+	}
+
+	printf("Compiled %d words into %s\n", word_count, imageFileName);
+	free(strings);
+	dict_data = NULL; // strings is not part of dict_map
+	free_dict();
+}
+
+void free_dict(void){
+	if(dict_mapped){
+		munmap(dict_map, dict_map_size);
+	}else{
+		free(dict_map);
+	}
+	if(!dict_from_image){
+		arena_free(&dict_arena);
+	}
+}
+
+// bit (c - 'a') for every letter c of the word, OTHER_CHAR_BIT for anything else
+unsigned int word_mask(const char *word, size_t length){
+	unsigned int mask = 0;
+	for(size_t i = 0; i < length; i++){
+		unsigned char letter = word[i];
+		if(letter >= 'a' && letter <= 'z'){
+			mask |= 1u << (letter - 'a');
+		}else{
+			mask |= OTHER_CHAR_BIT;
 		}
+	}
+	return mask;
+}
 
-		size_t word_length = strlen(line) + 1;
-		solution[solution_size] = malloc(word_length);
-		if(!solution[solution_size]){
-			printf("Failed to allocate memory for solution.\n");
-			free(line);
-			exit(1);
+// OFF_BOARD and/or SAME_SIDE for the word, from one pass over letter_side[]
+int word_side_flags(const char *word, size_t length){
+	int flags = 0;
+	size_t i = 0;
+	unsigned char prev = START_SIDE;
+
+	// long words: look up 8 sides, then compare each with its predecessor and with NO_SIDE
+	// in one 64-bit operation each, instead of two branches per letter
+	if(length >= WORD_AT_A_TIME_MIN){
+		unsigned long long prev_side = START_SIDE;
+		for(; i + 8 <= length; i += 8){
+			unsigned long long sides = 0;
+			for(int k = 0; k < 8; k++){
+				sides |= (unsigned long long)letter_side[(unsigned char)word[i + k]] << (8 * k);
+			}
+			unsigned long long prev_sides = (sides << 8) | prev_side; // byte k: side of letter i + k - 1
+			if(HAS_ZERO_BYTE(sides ^ prev_sides)){flags |= SAME_SIDE;}
+			if(HAS_ZERO_BYTE(~sides)){flags |= OFF_BOARD;}
+			prev_side = sides >> 56;
 		}
+		prev = prev_side;
+	}
 
-		strncpy(solution[solution_size++], line, word_length);
+	for(; i < length; i++){
+		unsigned char side = letter_side[(unsigned char)word[i]];
+		if(side == NO_SIDE){flags |= OFF_BOARD;}
+		if(side == prev){flags |= SAME_SIDE;}
+		prev = side;
 	}
+	return flags;
+}
 
-	free(line);
+// collect the words that are playable on the board: only board letters and no same-side
+// pair. The letter masks reject most of the dictionary without looking at the words.
+void filter_dict(void){
+	num_candidates = 0;
+	candidates = malloc(sizeof(int) * (dict_size + 1));
+	if(!candidates){
+		printf("Failed to allocate memory for candidate words.\n");
+		exit(1);
+	}
 
-	// Count letters in the solution after loading
-    for (int i = 0; i < solution_size; i++) {
-        for (size_t j = 0; j < strlen(solution[i]); j++) {
-            char letter = solution[i][j];
-            if (letter >= 'a' && letter <= 'z') {
-                letters_counter_solution[letter - 'a']++;
-            }
-        }
-    }
+	for(int i = 0; i < dict_size; i++){
+		if((dict_masks[i] & ~board_mask) != 0 || dict[i].length == 0){continue;}
+		if(word_side_flags(dict_data + dict[i].offset, dict[i].length) != 0){continue;}
+		candidates[num_candidates++] = i;
+	}
 }
 
-int is_in_dict(const char *word){
+// FNV-1a, cheap and good enough to spread dictionary words over the index
+unsigned int hash_word(const char *word, size_t length){
+	unsigned int hash = 2166136261u;
+	for(size_t i = 0; i < length; i++){
+		hash ^= (unsigned char)word[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// 1 if dictionary entry i is exactly the given word
+static int dict_word_equals(unsigned int i, const char *word, size_t length){
+	return dict[i].length == length && memcmp(dict_data + dict[i].offset, word, length) == 0;
+}
+
+void build_dict_index(void){
+	// keep the table at most half full so probe sequences stay short
+	unsigned int slots = 16;
+	while(slots < 2u * (unsigned int)dict_size){
+		slots *= 2;
+	}
+	dict_index_mask = slots - 1;
+
+	dict_index = arena_alloc(&dict_arena, sizeof(unsigned int) * slots);
+	memset(dict_index, 0xff, sizeof(unsigned int) * slots); // every slot EMPTY_SLOT
+
+	// a word that is already in the index is dropped from dict, so that the solver does not
+	// find every solution with it twice
+	int kept = 0;
 	for(int i = 0; i < dict_size; i++){
-		if(strcmp(dict[i], word) == 0){return 1;}
+		const char *word = dict_data + dict[i].offset;
+		unsigned int slot = hash_word(word, dict[i].length) & dict_index_mask;
+		while(dict_index[slot] != EMPTY_SLOT && !dict_word_equals(dict_index[slot], word, dict[i].length)){
+			slot = (slot + 1) & dict_index_mask;
+		}
+		if(dict_index[slot] != EMPTY_SLOT){continue;} // duplicate word
+		dict[kept] = dict[i];
+		dict_masks[kept] = dict_masks[i];
+		dict_index[slot] = kept++;
 	}
-	return 0;// not found
+	dict_size = kept;
 }
 
-int prev_match_curr(const char* prev, const char* curr){
-	char last_let_prev = prev[strlen(prev) - 1];
-	char first_let_curr = curr[0];
+int is_in_dict(const char *word){
+	size_t length = strlen(word);
+	unsigned int slot = hash_word(word, length) & dict_index_mask;
 
-	return last_let_prev == first_let_curr;
+	// linear probing: the word is either in its run of slots or not at all
+	while(dict_index[slot] != EMPTY_SLOT){
+		if(dict_word_equals(dict_index[slot], word, length)){return 1;}
+		slot = (slot + 1) & dict_index_mask;
+	}
+	return 0;// not found
 }
 
 int is_same_side_consecutive(const char *word){
+	return (word_side_flags(word, strlen(word)) & SAME_SIDE) != 0;
+}
+
+int is_on_board(const char *word){
+	return (word_side_flags(word, strlen(word)) & OFF_BOARD) == 0;
+}
+
+// the original strchr-based rule checks, kept as the baseline for --bench
+int is_same_side_consecutive_scan(const char *word){
 	int prev_side = -1;
 
 	for(int i = 0; word[i] != '\0'; i++){
@@ -284,7 +947,7 @@ int is_same_side_consecutive(const char *word){
 	return 0;
 }
 
-int is_on_board(const char *word){
+int is_on_board_scan(const char *word){
 	for (int i = 0; word[i] != '\0'; i++){
 		char let = word[i];
 		int found = 0;
@@ -303,49 +966,1367 @@ int is_on_board(const char *word){
 	return 1; //found
 }
 
-
 void test_solution(void){
-	read_solution();
+	solution_check check;
+	int result = check_solution(stdin, &check);
+	if(show_stats && check.lookups > 0){
+		fprintf(stderr, "dict: %d lookups, %.1f ns per lookup\n", check.lookups, check.lookup_ms * 1e6 / check.lookups);
+	}
+	printf("%s\n", result_messages[result]);
+	exit(0);
+}
 
-	// rules check
-	// 1. Check that all letters are on the board
-	for(int i = 0; i < solution_size; i++){
-		if(!is_on_board(solution[i])){
-			printf("Used a letter not present on the board\n");
-			exit(0);
+// check the next word of a solution against the rules. The rules are reported in this
+// order, no matter which word breaks them:
+// 1. all letters are on the board
+// 2. each word is in the dictionary
+// 3. consecutive letters within each word are not on same side
+// 4. last char of prev matches first char of next
+// 5. all letters on the board are used (checked once the solution ends)
+// So a word only needs the checks that could still change check->result. Returns 0 once
+// nothing can: the solution uses a letter not on the board.
+int check_word(solution_check* check, const char* word, size_t length){
+	int flags = word_side_flags(word, length);
+	if(flags & OFF_BOARD){
+		check->result = RESULT_OFF_BOARD;
+		return 0;
+	}
+
+	int result = check->result;
+	if(result == RESULT_CORRECT || result > RESULT_NOT_IN_DICT){
+		double start = show_stats ? now_ms() : 0;
+		int found = is_in_dict(word);
+		if(show_stats){
+			check->lookup_ms += now_ms() - start;
+			check->lookups++;
+		}
+		if(!found){
+			result = RESULT_NOT_IN_DICT;
 		}
 	}
-	// 2. Check that each word is in the dictionary
-	for(int i = 0; i < solution_size; i++){
-		if(!is_in_dict(solution[i])){
-			printf("Word not found in dictionary\n");
-			exit(0);
+	if((result == RESULT_CORRECT || result > RESULT_SAME_SIDE) && (flags & SAME_SIDE)){
+		result = RESULT_SAME_SIDE;
+	}
+	if((result == RESULT_CORRECT || result > RESULT_NO_MATCH) && check->words > 0 && check->last != word[0]){
+		result = RESULT_NO_MATCH;
+	}
+	check->result = result;
+
+	check->last = length > 0 ? word[length - 1] : '\0';
+	check->used_mask |= word_mask(word, length);
+	check->words++;
+	return 1;
+}
+
+// check the solution read from input, one word per line, against the loaded board.
+// Returns RESULT_CORRECT or the most important rule broken.
+int check_solution(FILE* input, solution_check* check){
+	memset(check, 0, sizeof(*check));
+
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t nread;
+	while((nread = getline(&line, &len, input)) != -1){
+		size_t length = strcspn(line, "\n");
+		line[length] = 0;
+		if(!check_word(check, line, length)){
+			break; // a letter off the board beats any other result, stop reading
 		}
 	}
-	// 3. Check that consecutive letters within each word are not on same side
-	for (int i = 0; i < solution_size; i++){
-        if (is_same_side_consecutive(solution[i])){
-            printf("Same-side letter used consecutively\n");
-            exit(0);
-        }
-    }
+	free(line);
+	return finish_check(check);
+}
 
-	// 4. Check that last char of prev matches first char of next
-	for (int i = 1; i < solution_size; i++){  // Start at the second word
-        if (!prev_match_curr(solution[i - 1], solution[i])){
-            printf("First letter of word does not match last letter of previous word\n");
-            exit(0);
-        }
-    }
+// the solution has ended, check that it used every letter on the board
+int finish_check(solution_check* check){
+	if(check->result == RESULT_CORRECT && (board_mask & ~check->used_mask) != 0){
+		check->result = RESULT_NOT_ALL_USED;
+	}
+	return check->result;
+}
 
-	// 5. Check all letters on the board are used.
-	for (int i = 0; i < NUM_LET; i++) {
-        if (letters_counter_board[i] > 0 && letters_counter_solution[i] == 0) {
-            printf("Not all letters used\n");
-            exit(0);
-        }
-    }
+// check one manifest line, "<board_file> <solution_file>"
+int check_case(char* line){
+	char *saveptr;
+	char *board_file = strtok_r(line, " \t", &saveptr);
+	char *solution_file = strtok_r(NULL, " \t", &saveptr);
+	if(!board_file || !solution_file || strtok_r(NULL, " \t", &saveptr)){
+		return RESULT_BAD_CASE;
+	}
 
-	printf("Correct\n");
-	exit(0);
+	int result = load_board(board_file);
+	if(result == RESULT_CORRECT){
+		FILE *input = fopen(solution_file, "r");
+		if(!input){
+			result = RESULT_OPEN_SOLUTION_FAILED;
+		}else{
+			solution_check check;
+			result = check_solution(input, &check);
+			fclose(input);
+		}
+	}
+	free_board();
+	return result;
+}
+
+// check every case of the manifest and print "<line>: <result>" for each, in manifest order.
+// The cases are read BATCH_CHUNK at a time and split between jobs forked worker processes,
+// which share the already loaded dictionary with this process and write their results
+// into a shared mapping.
+void run_batch(FILE* manifest, int jobs){
+	char **lines = malloc(sizeof(char *) * BATCH_CHUNK);
+	unsigned char *results = mmap(NULL, BATCH_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pid_t *pids = malloc(sizeof(pid_t) * jobs);
+	if(!lines || results == MAP_FAILED || !pids){
+		printf("Failed to allocate memory for batch.\n");
+		exit(1);
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	long total = 0;
+	double start = now_ms();
+	int done = 0;
+	while(!done){
+		int count = 0;
+		while(count < BATCH_CHUNK){
+			if(getline(&line, &len, manifest) == -1){
+				done = 1;
+				break;
+			}
+			line[strcspn(line, "\n")] = 0;
+			if(line[0] == '\0'){continue;}
+			lines[count++] = strdup(line);
+		}
+		if(count == 0){break;}
+
+		memset(results, RESULT_NOT_CHECKED, count);
+		fflush(stdout); // or the children would flush our buffered output again
+		int workers = jobs < count ? jobs : count;
+		for(int w = 0; w < workers; w++){
+			pids[w] = fork();
+			if(pids[w] < 0){
+				printf("Failed to fork batch worker.\n");
+				exit(1);
+			}
+			if(pids[w] == 0){
+				for(int i = w; i < count; i += workers){
+					results[i] = check_case(lines[i]);
+				}
+				_exit(0);
+			}
+		}
+		for(int w = 0; w < workers; w++){
+			waitpid(pids[w], NULL, 0);
+		}
+
+		for(int i = 0; i < count; i++){
+			printf("%s: %s\n", lines[i], result_messages[results[i]]);
+			free(lines[i]);
+		}
+		total += count;
+	}
+
+	if(show_stats){
+		double elapsed = now_ms() - start;
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		fprintf(stderr, "batch: %ld cases in %.3f ms, %.0f cases/s, peak RSS %.1f MB\n", total, elapsed,
+				elapsed > 0 ? total * 1e3 / elapsed : 0, usage.ru_maxrss / 1024.0);
+	}
+	free(line);
+	free(lines);
+	free(pids);
+	munmap(results, BATCH_CHUNK);
+}
+
+// serve requests on a Unix domain socket until SIGINT or SIGTERM. One line per request:
+//   check <board_file> <word> <word> ...   answered with one result line
+//   solve <board_file>                     answered with every shortest solution, then an empty line
+// All clients are served by one poll() loop, and boards stay loaded in board_cache.
+void run_server(const char* socketPath, int threads){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(socketPath) >= sizeof(addr.sun_path)){
+		printf("Socket path too long\n");
+		exit(1);
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(listen_fd < 0){
+		printf("socket failed\n");
+		exit(1);
+	}
+	unlink(socketPath); // left behind by a server that was killed
+	if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0){
+		printf("bind socket failed\n");
+		exit(1);
+	}
+
+	server_running = 1;
+	signal(SIGINT, stop_server);
+	signal(SIGTERM, stop_server);
+	signal(SIGPIPE, SIG_IGN);
+
+	int num_clients = 0;
+	int clients_capacity = 16;
+	server_client *clients = malloc(sizeof(server_client) * clients_capacity);
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * (clients_capacity + 1 + BOARD_CACHE_SIZE));
+	if(!clients || !fds){
+		printf("Failed to allocate memory for server.\n");
+		exit(1);
+	}
+
+	char buffer[65536];
+	while(server_running){
+		// the listening socket, the clients, then the pipes of the running solves
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for(int i = 0; i < num_clients; i++){
+			// a client waiting for a solve is not read from, so its answers stay in order
+			short events = (clients[i].closing || clients[i].waiting ? 0 : POLLIN) |
+						   (clients[i].out_sent < clients[i].out_size ? POLLOUT : 0);
+			fds[i + 1].fd = events ? clients[i].fd : -1;
+			fds[i + 1].events = events;
+		}
+		int polled = num_clients;
+		int solving = 0;
+		for(int i = 0; i < BOARD_CACHE_SIZE; i++){
+			if(board_cache[i].solver_pid > 0){
+				fds[polled + 1 + solving].fd = board_cache[i].solver_fd;
+				fds[polled + 1 + solving++].events = POLLIN;
+			}
+		}
+		if(poll(fds, polled + 1 + solving, -1) < 0){
+			if(errno == EINTR){continue;}
+			printf("poll failed\n");
+			exit(1);
+		}
+
+		// collect solver output, and answer the clients waiting for a solve once it is done
+		solving = 0;
+		for(int i = 0; i < BOARD_CACHE_SIZE; i++){
+			cached_board *entry = &board_cache[i];
+			if(entry->solver_pid <= 0){continue;}
+			if(!(fds[polled + 1 + solving++].revents & (POLLIN | POLLHUP | POLLERR))){continue;}
+			if(entry->solutions_size == entry->solutions_capacity){
+				entry->solutions_capacity *= 2;
+				entry->solutions = realloc(entry->solutions, entry->solutions_capacity);
+				if(!entry->solutions){
+					printf("Failed to allocate memory for solutions.\n");
+					exit(1);
+				}
+			}
+			ssize_t nread = read(entry->solver_fd, entry->solutions + entry->solutions_size,
+								 entry->solutions_capacity - entry->solutions_size);
+			if(nread > 0){
+				entry->solutions_size += nread;
+			}else if(nread == 0 || (errno != EAGAIN && errno != EINTR)){
+				finish_solve(entry, clients, num_clients, threads);
+			}
+		}
+
+		for(int i = 0; i < polled; i++){
+			server_client *client = &clients[i];
+			if(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)){
+				ssize_t nread = read(client->fd, buffer, sizeof(buffer));
+				if(nread <= 0){
+					if(nread == 0 || (errno != EAGAIN && errno != EINTR)){
+						client->closing = 1;
+					}
+				}else{
+					if(client->in_size + nread > client->in_capacity){
+						while(client->in_size + nread > client->in_capacity){
+							client->in_capacity = client->in_capacity ? client->in_capacity * 2 : 4096;
+						}
+						client->in = realloc(client->in, client->in_capacity);
+						if(!client->in){
+							printf("Failed to allocate memory for request.\n");
+							exit(1);
+						}
+					}
+					memcpy(client->in + client->in_size, buffer, nread);
+					client->in_size += nread;
+					serve_lines(client, threads);
+				}
+			}
+
+			// most responses fit into the socket right away, no need to wait for POLLOUT
+			while(client->out_sent < client->out_size){
+				ssize_t nwritten = send(client->fd, client->out + client->out_sent, client->out_size - client->out_sent, MSG_NOSIGNAL);
+				if(nwritten < 0){
+					if(errno != EAGAIN && errno != EINTR){
+						client->closing = 1;
+						client->out_sent = client->out_size;
+					}
+					break;
+				}
+				client->out_sent += nwritten;
+			}
+			if(client->out_sent == client->out_size){
+				client->out_sent = client->out_size = 0;
+			}
+		}
+
+		// drop the clients that are done, keeping the others in order. One that still waits
+		// for a solve is kept until it is answered.
+		int kept = 0;
+		for(int i = 0; i < num_clients; i++){
+			if(clients[i].closing && clients[i].out_size == 0 && !clients[i].waiting){
+				close(clients[i].fd);
+				free(clients[i].in);
+				free(clients[i].out);
+			}else{
+				clients[kept++] = clients[i];
+			}
+		}
+		num_clients = kept;
+
+		if(fds[0].revents & POLLIN){
+			int fd;
+			while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+				if(num_clients >= clients_capacity){
+					clients_capacity *= 2;
+					clients = realloc(clients, sizeof(server_client) * clients_capacity);
+					fds = realloc(fds, sizeof(struct pollfd) * (clients_capacity + 1 + BOARD_CACHE_SIZE));
+					if(!clients || !fds){
+						printf("Failed to allocate memory for server.\n");
+						exit(1);
+					}
+				}
+				memset(&clients[num_clients], 0, sizeof(server_client));
+				clients[num_clients++].fd = fd;
+			}
+		}
+	}
+
+	if(show_stats){
+		fprintf(stderr, "serve: %ld requests, %.1f us per request\n", server_requests,
+				server_requests > 0 ? server_request_ms * 1e3 / server_requests : 0);
+	}
+	for(int i = 0; i < num_clients; i++){
+		close(clients[i].fd);
+		free(clients[i].in);
+		free(clients[i].out);
+	}
+	free(clients);
+	free(fds);
+	close(listen_fd);
+	unlink(socketPath);
+
+	board = NULL; // it belongs to board_cache
+	for(int i = 0; i < BOARD_CACHE_SIZE; i++){
+		drop_cached_board(&board_cache[i]);
+	}
+}
+
+void stop_server(int sig){
+	(void)sig;
+	server_running = 0;
+}
+
+// --client: send the lines of stdin to a server and print its answers, so that scripts can
+// talk to it without a tool for Unix domain sockets. Returns the exit code.
+int run_client(const char* socketPath){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(socketPath) >= sizeof(addr.sun_path)){
+		printf("Socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		printf("connect to server failed\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	// requests and answers are copied at the same time, so neither side fills up its
+	// socket buffer while the other one waits
+	char request[65536];
+	char answer[65536];
+	size_t request_size = 0;
+	size_t request_sent = 0;
+	int input_open = 1;
+	while(1){
+		struct pollfd fds[2] = {{.fd = -1}, {.fd = fd, .events = POLLIN}};
+		if(request_sent < request_size){
+			fds[1].events |= POLLOUT;
+		}else if(input_open){
+			fds[0].fd = STDIN_FILENO;
+			fds[0].events = POLLIN;
+		}
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR){continue;}
+			printf("poll failed\n");
+			return 1;
+		}
+
+		if(fds[0].revents){
+			ssize_t nread = read(STDIN_FILENO, request, sizeof(request));
+			if(nread <= 0){
+				input_open = 0;
+				shutdown(fd, SHUT_WR); // the server answers the rest and closes
+			}else{
+				request_size = nread;
+				request_sent = 0;
+			}
+		}
+		if(fds[1].revents & POLLOUT){
+			ssize_t nwritten = send(fd, request + request_sent, request_size - request_sent, MSG_DONTWAIT);
+			if(nwritten < 0 && errno != EAGAIN && errno != EINTR){
+				printf("send to server failed\n");
+				return 1;
+			}
+			if(nwritten > 0){
+				request_sent += nwritten;
+			}
+		}
+		if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)){
+			ssize_t nread = read(fd, answer, sizeof(answer));
+			if(nread <= 0){break;}
+			fwrite(answer, 1, nread, stdout);
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+// find a board in board_cache, loading it into the cache (replacing the oldest board when it
+// is full) if it is not there yet, or if the file changed since. Returns RESULT_CORRECT, or
+// why the board cannot be used.
+int cache_board(const char* fileName, cached_board** entry){
+	struct stat st;
+	int found = stat(fileName, &st) == 0;
+	for(int i = 0; i < BOARD_CACHE_SIZE; i++){
+		cached_board *slot = &board_cache[i];
+		if(!slot->name || strcmp(slot->name, fileName) != 0){continue;}
+		// a board being solved stays as it is until the solve is done
+		if(slot->solver_pid > 0 || (found && st.st_size == slot->size &&
+		   st.st_mtim.tv_sec == slot->mtime.tv_sec && st.st_mtim.tv_nsec == slot->mtime.tv_nsec)){
+			*entry = slot;
+			return RESULT_CORRECT;
+		}
+		drop_cached_board(slot); // changed, load it again
+		break;
+	}
+
+	// the oldest slot that is not being solved
+	cached_board *slot = NULL;
+	for(int tries = 0; tries < BOARD_CACHE_SIZE && !slot; tries++){
+		if(board_cache[board_cache_next].solver_pid <= 0){
+			slot = &board_cache[board_cache_next];
+		}
+		board_cache_next = (board_cache_next + 1) % BOARD_CACHE_SIZE;
+	}
+	if(!slot){
+		return RESULT_SERVER_BUSY;
+	}
+
+	int result = load_board(fileName);
+	if(result != RESULT_CORRECT){
+		free_board();
+		return result;
+	}
+
+	drop_cached_board(slot);
+	slot->name = strdup(fileName);
+	if(!slot->name){
+		printf("Failed to allocate memory for board\n");
+		exit(1);
+	}
+	slot->sides = board;
+	slot->num_sides = num_sides;
+	slot->storage = board_arena;
+	slot->mask = board_mask;
+	memcpy(slot->letter_side, letter_side, sizeof(letter_side));
+	slot->mtime = found ? st.st_mtim : (struct timespec){0};
+	slot->size = found ? st.st_size : -1;
+
+	board = NULL; // the sides now belong to the cache
+	board_arena.head = NULL;
+	*entry = slot;
+	return RESULT_CORRECT;
+}
+
+// free a board_cache slot, stopping its solve if one is running
+void drop_cached_board(cached_board* entry){
+	if(entry->solver_pid > 0){
+		kill(entry->solver_pid, SIGKILL);
+		waitpid(entry->solver_pid, NULL, 0);
+		close(entry->solver_fd);
+	}
+	if(entry->name){
+		arena_free(&entry->storage);
+	}
+	free(entry->name);
+	free(entry->solutions);
+	memset(entry, 0, sizeof(cached_board));
+}
+
+// make a cached board the current one for the rule checks and the solvers
+void use_board(const cached_board* entry){
+	board = entry->sides;
+	num_sides = entry->num_sides;
+	board_mask = entry->mask;
+	memcpy(letter_side, entry->letter_side, sizeof(letter_side));
+}
+
+// answer one request line, see run_server()
+void serve_request(server_client* client, char* line, int threads){
+	char *saveptr;
+	char *command = strtok_r(line, " \t\r", &saveptr);
+	if(!command){return;} // empty line
+	char *board_file = strtok_r(NULL, " \t\r", &saveptr);
+	int is_check = strcmp(command, "check") == 0;
+	int is_solve = strcmp(command, "solve") == 0;
+	if(!board_file || (!is_check && !is_solve)){
+		const char *message = result_messages[RESULT_BAD_REQUEST];
+		queue_response(client, message, strlen(message));
+		queue_response(client, "\n", 1);
+		return;
+	}
+
+	cached_board *entry;
+	int result = cache_board(board_file, &entry);
+	if(result == RESULT_CORRECT){
+		use_board(entry);
+	}
+
+	if(is_check){
+		if(result == RESULT_CORRECT){
+			solution_check check;
+			memset(&check, 0, sizeof(check));
+			char *word;
+			while((word = strtok_r(NULL, " \t\r", &saveptr))){
+				if(!check_word(&check, word, strlen(word))){
+					break; // a letter off the board beats any other result
+				}
+			}
+			result = finish_check(&check);
+		}
+		const char *message = result_messages[result];
+		queue_response(client, message, strlen(message));
+		queue_response(client, "\n", 1);
+		return;
+	}
+
+	if(result != RESULT_CORRECT){
+		const char *message = result_messages[result];
+		queue_response(client, message, strlen(message));
+		queue_response(client, "\n\n", 2);
+		return;
+	}
+	// solve once per board, later requests get the same answer. Until the solver is done
+	// the client waits, and the others are served in the meantime.
+	if(!entry->solutions){
+		start_solve(entry, threads);
+	}
+	if(entry->solver_pid > 0){
+		client->waiting = entry;
+		return;
+	}
+	queue_response(client, entry->solutions, entry->solutions_size);
+	queue_response(client, "\n", 1);
+}
+
+// answer every complete line the client sent, keep the rest for the next read. Stops at a
+// request that has to wait for a solve, finish_solve() goes on from there.
+void serve_lines(server_client* client, int threads){
+	size_t done = 0;
+	char *newline;
+	while(!client->waiting && (newline = memchr(client->in + done, '\n', client->in_size - done))){
+		*newline = 0;
+		double start = show_stats ? now_ms() : 0;
+		serve_request(client, client->in + done, threads);
+		if(show_stats){
+			server_request_ms += now_ms() - start;
+		}
+		server_requests++;
+		done = newline + 1 - client->in;
+	}
+	memmove(client->in, client->in + done, client->in_size - done);
+	client->in_size -= done;
+	if(client->in_size > MAX_REQUEST_LENGTH){
+		client->closing = 1;
+		client->out_sent = client->out_size; // drop it, it is not talking our protocol
+	}
+}
+
+// solve the current board in a child process, which writes the solutions to a pipe that
+// run_server() reads into entry->solutions
+void start_solve(cached_board* entry, int threads){
+	int pipe_fds[2];
+	if(pipe2(pipe_fds, O_CLOEXEC) < 0){
+		printf("pipe failed\n");
+		exit(1);
+	}
+	entry->solutions_capacity = 4096;
+	entry->solutions_size = 0;
+	entry->solutions = malloc(entry->solutions_capacity);
+	if(!entry->solutions){
+		printf("Failed to allocate memory for solutions.\n");
+		exit(1);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if(pid < 0){
+		printf("fork failed\n");
+		exit(1);
+	}
+	if(pid == 0){
+		close(pipe_fds[0]);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		solution_output = fdopen(pipe_fds[1], "w");
+		if(!solution_output){
+			_exit(1);
+		}
+		filter_dict();
+		build_word_classes();
+		long found = threads > 0 ? solve_parallel(threads) : solve();
+		if(found == 0){
+			fprintf(solution_output, "No solution\n");
+		}
+		_exit(fclose(solution_output) == 0 ? 0 : 1);
+	}
+	close(pipe_fds[1]);
+	fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+	entry->solver_pid = pid;
+	entry->solver_fd = pipe_fds[0];
+}
+
+// the solver of a board is done: keep its answer and send it to the clients that were
+// waiting for it. If it failed, they are told so, and the next request tries again.
+void finish_solve(cached_board* entry, server_client* clients, int num_clients, int threads){
+	int status;
+	close(entry->solver_fd);
+	waitpid(entry->solver_pid, &status, 0);
+	entry->solver_pid = 0;
+	entry->solver_fd = -1;
+	int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+	// answer all of them before any goes on with its next request, which may solve again
+	int *answered = malloc(sizeof(int) * (num_clients + 1));
+	int num_answered = 0;
+	if(!answered){
+		printf("Failed to allocate memory for server.\n");
+		exit(1);
+	}
+	for(int i = 0; i < num_clients; i++){
+		if(clients[i].waiting != entry){continue;}
+		clients[i].waiting = NULL;
+		if(failed){
+			const char *message = result_messages[RESULT_SOLVE_FAILED];
+			queue_response(&clients[i], message, strlen(message));
+			queue_response(&clients[i], "\n\n", 2);
+		}else{
+			queue_response(&clients[i], entry->solutions, entry->solutions_size);
+			queue_response(&clients[i], "\n", 1);
+		}
+		answered[num_answered++] = i;
+	}
+	if(failed){
+		free(entry->solutions);
+		entry->solutions = NULL;
+		entry->solutions_size = 0;
+	}
+	for(int i = 0; i < num_answered; i++){
+		serve_lines(&clients[answered[i]], threads);
+	}
+	free(answered);
+}
+
+// add to the data waiting to be sent to a client
+void queue_response(server_client* client, const char* data, size_t size){
+	if(client->out_size + size > client->out_capacity){
+		while(client->out_size + size > client->out_capacity){
+			client->out_capacity = client->out_capacity ? client->out_capacity * 2 : 4096;
+		}
+		client->out = realloc(client->out, client->out_capacity);
+		if(!client->out){
+			printf("Failed to allocate memory for response.\n");
+			exit(1);
+		}
+	}
+	memcpy(client->out + client->out_size, data, size);
+	client->out_size += size;
+}
+
+double now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// time loading the whole dictionary (timed by main()) and looking up every word in it
+void bench_dict(double load_ms){
+	enum { LOOKUP_ROUNDS = 5 };
+	printf("load: %.1f MB in %.3f ms (%.1f MB/s), %d words\n", dict_data_size / 1e6, load_ms,
+		   load_ms > 0 ? dict_data_size / 1e3 / load_ms : 0, dict_size);
+
+	// every word of the dictionary, and the same words with a character no word has
+	size_t max_length = 0;
+	for(int i = 0; i < dict_size; i++){
+		if(dict[i].length > max_length){max_length = dict[i].length;}
+	}
+	char *word = malloc(max_length + 2);
+	if(!word){
+		printf("Failed to allocate memory for benchmark words.\n");
+		exit(1);
+	}
+	double lookup_ns[2];
+	for(int miss = 0; miss < 2 && dict_size > 0; miss++){
+		volatile int sink = 0;
+		double start = now_ms();
+		for(int round = 0; round < LOOKUP_ROUNDS; round++){
+			for(int i = 0; i < dict_size; i++){
+				memcpy(word, dict_data + dict[i].offset, dict[i].length);
+				word[dict[i].length] = '#';
+				word[dict[i].length + miss] = '\0';
+				sink += is_in_dict(word);
+			}
+		}
+		lookup_ns[miss] = (now_ms() - start) * 1e6 / ((double)dict_size * LOOKUP_ROUNDS);
+	}
+	free(word);
+	if(dict_size > 0){
+		printf("lookup: %d words: %.1f ns per hit, %.1f ns per miss\n", dict_size, lookup_ns[0], lookup_ns[1]);
+	}
+}
+
+// time the rest on the board and the words read_dict() kept for it: rule checks, validating
+// a solution, and solving, then report the peak memory use
+void bench_all(void){
+	bench_rules();
+
+	// the whole dictionary as one solution, which takes every check up to the chain rule
+	char *text = malloc(dict_data_size + dict_size + 1);
+	if(!text){
+		printf("Failed to allocate memory for benchmark solution.\n");
+		exit(1);
+	}
+	size_t text_size = 0;
+	for(int i = 0; i < dict_size; i++){
+		memcpy(text + text_size, dict_data + dict[i].offset, dict[i].length);
+		text_size += dict[i].length;
+		text[text_size++] = '\n';
+	}
+	if(text_size > 0){
+		FILE *input = fmemopen(text, text_size, "r");
+		if(!input){
+			printf("Failed to allocate memory for benchmark solution.\n");
+			exit(1);
+		}
+		solution_check check;
+		double start = now_ms();
+		int result = check_solution(input, &check);
+		double elapsed = now_ms() - start;
+		fclose(input);
+		printf("validate: %d words in %.3f ms (%.0f words/s): %s\n", check.words, elapsed,
+			   elapsed > 0 ? check.words * 1e3 / elapsed : 0, result_messages[result]);
+	}
+	free(text);
+
+	solution_output = fopen("/dev/null", "w");
+	if(!solution_output){
+		printf("open /dev/null failed\n");
+		exit(1);
+	}
+	double start = now_ms();
+	build_word_classes();
+	long found = solve();
+	printf("solve: %ld solutions, %d playable words, %d word classes, %d states in %.3f ms\n",
+		   found, num_candidates, num_classes, num_states, now_ms() - start);
+	fclose(solution_output);
+	solution_output = stdout;
+	free_solver();
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("memory: peak RSS %.1f MB\n", usage.ru_maxrss / 1024.0);
+}
+
+// time both rule check implementations on the dictionary words and on long random words
+void bench_rules(void){
+	enum { LONG_WORDS = 1000, LONG_LENGTH = 256, ROUNDS = 20 };
+	int num_words = dict_size + LONG_WORDS;
+	char **words = malloc(sizeof(char *) * num_words);
+	if(!words){
+		printf("Failed to allocate memory for benchmark words.\n");
+		exit(1);
+	}
+	for(int i = 0; i < dict_size; i++){
+		words[i] = strndup(dict_data + dict[i].offset, dict[i].length);
+	}
+
+	// valid walks over the board, the worst case for both implementations
+	srand(537);
+	for(int i = dict_size; i < num_words; i++){
+		words[i] = malloc(LONG_LENGTH + 1);
+		int side = -1;
+		for(int j = 0; j < LONG_LENGTH; j++){
+			int next = rand() % (num_sides - 1);
+			side = next >= side ? next + 1 : next; // any side but the previous one
+			words[i][j] = board[side][rand() % strlen(board[side])];
+		}
+		words[i][LONG_LENGTH] = '\0';
+	}
+
+	const char *set_names[2] = {"dictionary words", "random 256-letter words"};
+	int set_start[3] = {0, dict_size, num_words};
+	for(int set = 0; set < 2; set++){
+		int count = set_start[set + 1] - set_start[set];
+		if(count == 0){continue;}
+		volatile int sink = 0;
+
+		double start = now_ms();
+		for(int round = 0; round < ROUNDS; round++){
+			for(int i = set_start[set]; i < set_start[set + 1]; i++){
+				sink += is_on_board_scan(words[i]) && !is_same_side_consecutive_scan(words[i]);
+			}
+		}
+		double scan_ns = (now_ms() - start) * 1e6 / ((double)count * ROUNDS);
+
+		start = now_ms();
+		for(int round = 0; round < ROUNDS; round++){
+			for(int i = set_start[set]; i < set_start[set + 1]; i++){
+				sink += is_on_board(words[i]) && !is_same_side_consecutive(words[i]);
+			}
+		}
+		double table_ns = (now_ms() - start) * 1e6 / ((double)count * ROUNDS);
+
+		printf("rules: %d %s: strchr scan %.1f ns/word, side table %.1f ns/word (%.1fx)\n",
+			   count, set_names[set], scan_ns, table_ns, scan_ns / table_ns);
+	}
+
+	for(int i = 0; i < num_words; i++){
+		free(words[i]);
+	}
+	free(words);
+}
+
+// qsort comparator for candidates: by first letter, letter count, last letter, letter mask, then position
+static int compare_candidates(const void *a, const void *b){
+	const dict_word *word_a = &dict[*(const int *)a];
+	const dict_word *word_b = &dict[*(const int *)b];
+	const char *text_a = dict_data + word_a->offset;
+	const char *text_b = dict_data + word_b->offset;
+	unsigned int mask_a = dict_masks[*(const int *)a];
+	unsigned int mask_b = dict_masks[*(const int *)b];
+
+	if(text_a[0] != text_b[0]){return text_a[0] - text_b[0];}
+	// words covering more letters first: the parallel solver finds short chains sooner
+	if(__builtin_popcount(mask_a) != __builtin_popcount(mask_b)){
+		return __builtin_popcount(mask_b) - __builtin_popcount(mask_a);
+	}
+	if(text_a[word_a->length - 1] != text_b[word_b->length - 1]){
+		return text_a[word_a->length - 1] - text_b[word_b->length - 1];
+	}
+	if(mask_a != mask_b){return mask_a < mask_b ? -1 : 1;}
+	return *(const int *)a - *(const int *)b;
+}
+
+// group the candidates into word classes, ordered by first letter
+void build_word_classes(void){
+	class_words = malloc(sizeof(int) * (num_candidates + 1));
+	word_classes = malloc(sizeof(word_class) * (num_candidates + 1));
+	if(!class_words || !word_classes){
+		printf("Failed to allocate memory for word classes.\n");
+		exit(1);
+	}
+	memcpy(class_words, candidates, sizeof(int) * num_candidates);
+	qsort(class_words, num_candidates, sizeof(int), compare_candidates);
+
+	num_classes = 0;
+	max_class_letters = 0;
+	for(int i = 0; i < num_candidates; i++){
+		const dict_word *word = &dict[class_words[i]];
+		int first = dict_data[word->offset] - 'a';
+		int last = dict_data[word->offset + word->length - 1] - 'a';
+		unsigned int mask = dict_masks[class_words[i]];
+
+		word_class *prev = num_classes > 0 ? &word_classes[num_classes - 1] : NULL;
+		if(prev && prev->first == first && prev->last == last && prev->mask == mask){
+			prev->count++;
+			continue;
+		}
+		word_classes[num_classes].mask = mask;
+		word_classes[num_classes].first = first;
+		word_classes[num_classes].last = last;
+		word_classes[num_classes].start = i;
+		word_classes[num_classes].count = 1;
+		num_classes++;
+		if(__builtin_popcount(mask) > max_class_letters){max_class_letters = __builtin_popcount(mask);}
+	}
+
+	int c = 0;
+	for(int letter = 0; letter <= NUM_LET; letter++){
+		while(c < num_classes && word_classes[c].first < letter){
+			c++;
+		}
+		class_start[letter] = c;
+	}
+}
+
+// the state for (mask, last), created at the given depth if it was never reached before
+int get_state(unsigned int mask, int last, int depth){
+	// grow the table (and rehash) once it gets half full
+	if((unsigned int)num_states * 2 >= state_table_mask + 1){
+		unsigned int slots = (state_table_mask + 1) * 2;
+		free(state_table);
+		state_table = malloc(sizeof(int) * slots);
+		if(!state_table){
+			printf("Failed to allocate memory for solver states.\n");
+			exit(1);
+		}
+		memset(state_table, 0xff, sizeof(int) * slots); // every slot -1
+		state_table_mask = slots - 1;
+		for(int i = 0; i < num_states; i++){
+			unsigned int key = (states[i].mask << 5) | states[i].last;
+			unsigned int slot = (key * 2654435761u) & state_table_mask;
+			while(state_table[slot] != -1){
+				slot = (slot + 1) & state_table_mask;
+			}
+			state_table[slot] = i;
+		}
+	}
+
+	unsigned int key = (mask << 5) | last;
+	unsigned int slot = (key * 2654435761u) & state_table_mask;
+	while(state_table[slot] != -1){
+		const solver_state *state = &states[state_table[slot]];
+		if(state->mask == mask && state->last == last){return state_table[slot];}
+		slot = (slot + 1) & state_table_mask;
+	}
+
+	if(num_states >= states_capacity){
+		states_capacity *= 2;
+		states = realloc(states, sizeof(solver_state) * states_capacity);
+		if(!states){
+			printf("Failed to allocate memory for solver states.\n");
+			exit(1);
+		}
+	}
+	states[num_states].mask = mask;
+	states[num_states].last = last;
+	states[num_states].depth = depth;
+	states[num_states].first_edge = -1;
+	state_table[slot] = num_states;
+	return num_states++;
+}
+
+void add_edge(int state, int parent, int word_class){
+	if(num_edges >= edges_capacity){
+		edges_capacity *= 2;
+		edges = realloc(edges, sizeof(solver_edge) * edges_capacity);
+		if(!edges){
+			printf("Failed to allocate memory for solver edges.\n");
+			exit(1);
+		}
+	}
+	edges[num_edges].parent = parent;
+	edges[num_edges].word_class = word_class;
+	edges[num_edges].next = states[state].first_edge;
+	states[state].first_edge = num_edges++;
+}
+
+// qsort comparator for found_chains: shorter chains first, then by their word classes
+static int compare_chains(const void *a, const void *b){
+	const int *chain_a = a;
+	const int *chain_b = b;
+	if(chain_a[0] != chain_b[0]){return chain_a[0] - chain_b[0];}
+	for(int i = 1; i <= chain_a[0]; i++){
+		if(chain_a[i] != chain_b[i]){return chain_a[i] - chain_b[i];}
+	}
+	return 0;
+}
+
+// print every shortest chain of candidate words that covers the board, one per line.
+// Breadth-first search over (covered letters, last letter) states: each state is expanded
+// once, at the depth it is first reached, and remembers every shortest way into it.
+long solve(void){
+	states_capacity = 1024;
+	edges_capacity = 1024;
+	state_table_mask = 1023;
+	states = malloc(sizeof(solver_state) * states_capacity);
+	edges = malloc(sizeof(solver_edge) * edges_capacity);
+	state_table = malloc(sizeof(int) * (state_table_mask + 1));
+	if(!states || !edges || !state_table){
+		printf("Failed to allocate memory for solver.\n");
+		exit(1);
+	}
+	memset(state_table, 0xff, sizeof(int) * (state_table_mask + 1));
+	num_states = 0;
+	num_edges = 0;
+
+	// depth 1: every word class on its own
+	for(int c = 0; c < num_classes; c++){
+		add_edge(get_state(word_classes[c].mask, word_classes[c].last, 1), -1, c);
+	}
+	int layer_start = 0; // states are created layer by layer, so a layer is a range of ids
+	int layer_end = num_states;
+	int depth = 1;
+
+	while(layer_start < layer_end){
+		int goals = 0;
+		for(int s = layer_start; s < layer_end; s++){
+			if(states[s].mask == board_mask){goals++;}
+		}
+		if(goals > 0){break;}
+
+		for(int s = layer_start; s < layer_end; s++){
+			int last = states[s].last;
+			for(int c = class_start[last]; c < class_start[last + 1]; c++){
+				int next = get_state(states[s].mask | word_classes[c].mask, word_classes[c].last, depth + 1);
+				if(states[next].depth == depth + 1){
+					add_edge(next, s, c);
+				}
+			}
+		}
+		layer_start = layer_end;
+		layer_end = num_states;
+		depth++;
+	}
+
+	if(layer_start == layer_end){
+		return 0; // every reachable state was visited, none covers the board
+	}
+
+	size_t max_length = 0;
+	for(int i = 0; i < num_candidates; i++){
+		if(dict[candidates[i]].length > max_length){max_length = dict[candidates[i]].length;}
+	}
+	int *chain = malloc(sizeof(int) * depth);
+	char *line = malloc((max_length + 1) * depth + 1);
+	if(!chain || !line){
+		printf("Failed to allocate memory for solutions.\n");
+		exit(1);
+	}
+
+	free(found_chains); // left by solve_parallel() when it found nothing
+	num_found = 0;
+	found_capacity = 64;
+	found_chains = malloc(sizeof(int) * (depth + 1) * found_capacity);
+	if(!found_chains){
+		printf("Failed to allocate memory for solutions.\n");
+		exit(1);
+	}
+	for(int s = layer_start; s < layer_end; s++){
+		if(states[s].mask == board_mask){
+			collect_chains(s, chain, depth, depth);
+		}
+	}
+
+	// in the order of their classes, the same order solve_parallel() prints them in
+	qsort(found_chains, num_found, sizeof(int) * (depth + 1), compare_chains);
+	long found = 0;
+	for(int i = 0; i < num_found; i++){
+		found += print_words(&found_chains[i * (depth + 1)] + 1, depth, 0, line, 0);
+	}
+	free(chain);
+	free(line);
+	return found;
+}
+
+// walk the edges back from a state reached after depth words; chain[0 .. depth) receives
+// the word classes in order, chain[depth .. length) already holds the rest of the chain.
+// Each whole chain is added to found_chains, as its length and then its length classes.
+void collect_chains(int state, int *chain, int length, int depth){
+	for(int e = states[state].first_edge; e != -1; e = edges[e].next){
+		chain[depth - 1] = edges[e].word_class;
+		if(edges[e].parent != -1){
+			collect_chains(edges[e].parent, chain, length, depth - 1);
+			continue;
+		}
+		if(num_found >= found_capacity){
+			found_capacity *= 2;
+			found_chains = realloc(found_chains, sizeof(int) * (length + 1) * found_capacity);
+			if(!found_chains){
+				printf("Failed to allocate memory for solutions.\n");
+				exit(1);
+			}
+		}
+		int *found = &found_chains[num_found++ * (length + 1)];
+		found[0] = length;
+		memcpy(found + 1, chain, sizeof(int) * length);
+	}
+}
+
+// print every choice of one word per class of the chain
+long print_words(const int *chain, int length, int pos, char *line, size_t line_length){
+	if(pos == length){
+		line[line_length - 1] = '\n';
+		fwrite(line, 1, line_length, solution_output);
+		return 1;
+	}
+
+	long found = 0;
+	const word_class *word_class = &word_classes[chain[pos]];
+	for(int i = word_class->start; i < word_class->start + word_class->count; i++){
+		const dict_word *word = &dict[class_words[i]];
+		memcpy(line + line_length, dict_data + word->offset, word->length);
+		line[line_length + word->length] = ' ';
+		found += print_words(chain, length, pos + 1, line, line_length + word->length + 1);
+	}
+	return found;
+}
+
+void free_solver(void){
+	free(word_classes);
+	free(class_words);
+	free(states);
+	free(edges);
+	free(state_table);
+	for(int i = 0; i < num_workers; i++){
+		free(workers[i].dead_keys);
+		free(workers[i].dead_budgets);
+	}
+	free(workers);
+	free(found_chains);
+	// the server solves again with the same globals
+	word_classes = NULL;
+	class_words = NULL;
+	states = NULL;
+	edges = NULL;
+	state_table = NULL;
+	workers = NULL;
+	num_workers = 0;
+	found_chains = NULL;
+}
+
+// the same solutions as solve(), from a depth-first branch and bound search per start class.
+// The start classes are split evenly over the threads, and a thread that runs out steals the
+// upper half of the largest remaining range. All threads share best_depth, so a short chain
+// found by one thread immediately prunes the search in all the others.
+long solve_parallel(int threads){
+	// a shortest solution practically never needs more words than the board has letters;
+	// if there is none that short, the exhaustive breadth-first search settles it
+	int max_depth = __builtin_popcount(board_mask);
+	atomic_store(&best_depth, max_depth);
+	num_found = 0;
+	found_capacity = 64;
+	found_chains = malloc(sizeof(int) * (NUM_LET + 1) * found_capacity);
+	num_workers = threads;
+	workers = calloc(num_workers, sizeof(solver_worker));
+	if(!found_chains || !workers){
+		printf("Failed to allocate memory for solver threads.\n");
+		exit(1);
+	}
+
+	for(int i = 0; i < num_workers; i++){
+		atomic_init(&workers[i].next_task, (long)num_classes * i / num_workers);
+		atomic_init(&workers[i].end_task, (long)num_classes * (i + 1) / num_workers);
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	for(int i = 0; i < num_workers; i++){
+		if(pthread_create(&workers[i].thread, NULL, solver_thread, &workers[i]) != 0){
+			printf("Failed to start solver thread.\n");
+			exit(1);
+		}
+	}
+	for(int i = 0; i < num_workers; i++){
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+
+	if(num_found == 0){
+		return solve();
+	}
+
+	// chains found before best_depth dropped to its final value are too long
+	int best = atomic_load(&best_depth);
+	size_t max_length = 0;
+	for(int i = 0; i < num_candidates; i++){
+		if(dict[candidates[i]].length > max_length){max_length = dict[candidates[i]].length;}
+	}
+	char *line = malloc((max_length + 1) * best + 1);
+	if(!line){
+		printf("Failed to allocate memory for solutions.\n");
+		exit(1);
+	}
+	// the threads find the chains in any order, print them in the order of their classes
+	qsort(found_chains, num_found, sizeof(int) * (NUM_LET + 1), compare_chains);
+	long found = 0;
+	for(int i = 0; i < num_found; i++){
+		const int *chain = &found_chains[i * (NUM_LET + 1)];
+		if(chain[0] == best){
+			found += print_words(chain + 1, best, 0, line, 0);
+		}
+	}
+	free(line);
+	return found;
+}
+
+void* solver_thread(void *arg){
+	solver_worker *worker = arg;
+	worker->dead_mask = 1023;
+	worker->dead_keys = malloc(sizeof(unsigned int) * (worker->dead_mask + 1));
+	worker->dead_budgets = malloc(worker->dead_mask + 1);
+	if(!worker->dead_keys || !worker->dead_budgets){
+		printf("Failed to allocate memory for solver thread.\n");
+		exit(1);
+	}
+	memset(worker->dead_keys, 0xff, sizeof(unsigned int) * (worker->dead_mask + 1)); // every key EMPTY_SLOT
+
+	int task;
+	while((task = take_task(worker)) != -1){
+		worker->chain[0] = task;
+		solve_from(worker, word_classes[task].mask, word_classes[task].last, 1);
+	}
+	return NULL;
+}
+
+// the next start class for this worker, stolen from another worker if it has none left
+int take_task(solver_worker *worker){
+	pthread_mutex_lock(&worker->lock);
+	int task = atomic_load_explicit(&worker->next_task, memory_order_relaxed);
+	if(task < atomic_load_explicit(&worker->end_task, memory_order_relaxed)){
+		atomic_store_explicit(&worker->next_task, task + 1, memory_order_relaxed);
+		pthread_mutex_unlock(&worker->lock);
+		return task;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	while(1){
+		solver_worker *victim = NULL;
+		int most = 0;
+		for(int i = 0; i < num_workers; i++){
+			// only a hint, checked under the lock
+			int left = atomic_load_explicit(&workers[i].end_task, memory_order_relaxed) -
+					   atomic_load_explicit(&workers[i].next_task, memory_order_relaxed);
+			if(left > most){
+				most = left;
+				victim = &workers[i];
+			}
+		}
+		if(!victim){return -1;}
+
+		pthread_mutex_lock(&victim->lock);
+		int end = atomic_load_explicit(&victim->end_task, memory_order_relaxed);
+		int left = end - atomic_load_explicit(&victim->next_task, memory_order_relaxed);
+		if(left <= 0){
+			pthread_mutex_unlock(&victim->lock);
+			continue; // someone else got there first
+		}
+		int split = end - (left + 1) / 2;
+		atomic_store_explicit(&victim->end_task, split, memory_order_relaxed);
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&worker->lock);
+		atomic_store_explicit(&worker->next_task, split + 1, memory_order_relaxed);
+		atomic_store_explicit(&worker->end_task, end, memory_order_relaxed);
+		worker->steals++;
+		pthread_mutex_unlock(&worker->lock);
+		return split;
+	}
+}
+
+// search on from a chain of depth words in worker->chain that covers mask and ends with last.
+// Returns 1 if a solution no longer than best_depth was found below this point.
+int solve_from(solver_worker *worker, unsigned int mask, int last, int depth){
+	if(mask == board_mask){
+		record_chain(worker->chain, depth);
+		return 1;
+	}
+
+	// a state that already failed with at least this many words left fails again
+	int budget = atomic_load_explicit(&best_depth, memory_order_relaxed) - depth;
+	int missing = __builtin_popcount(board_mask & ~mask);
+	if(missing > budget * max_class_letters){return 0;}
+	unsigned int key = (mask << 5) | last;
+	unsigned int slot = (key * 2654435761u) & worker->dead_mask;
+	while(worker->dead_keys[slot] != EMPTY_SLOT && worker->dead_keys[slot] != key){
+		slot = (slot + 1) & worker->dead_mask;
+	}
+	if(budget <= 0 || (worker->dead_keys[slot] == key && worker->dead_budgets[slot] >= budget)){
+		return 0;
+	}
+
+	int found = 0;
+	for(int c = class_start[last]; c < class_start[last + 1]; c++){
+		int best = atomic_load_explicit(&best_depth, memory_order_relaxed);
+		if(depth >= best){break;}
+		// classes are sorted by letter count: if this one cannot cover the rest in time,
+		// neither can any of the following ones
+		int reach = (best - depth - 1) * max_class_letters;
+		if(__builtin_popcount(word_classes[c].mask) + reach < missing){break;}
+		if(__builtin_popcount(word_classes[c].mask & ~mask) + reach < missing){continue;}
+		worker->chain[depth] = c;
+		found |= solve_from(worker, mask | word_classes[c].mask, word_classes[c].last, depth + 1);
+	}
+	if(found){return 1;}
+
+	// every branch was searched with at least this many words left
+	budget = atomic_load_explicit(&best_depth, memory_order_relaxed) - depth;
+	if(budget <= 0){return 0;}
+	if(worker->dead_keys[slot] != key){
+		// the map may have been grown by the recursion, find the slot again
+		if((unsigned int)worker->dead_size * 2 >= worker->dead_mask){
+			unsigned int old_mask = worker->dead_mask;
+			unsigned int *old_keys = worker->dead_keys;
+			unsigned char *old_budgets = worker->dead_budgets;
+			worker->dead_mask = old_mask * 2 + 1;
+			worker->dead_keys = malloc(sizeof(unsigned int) * (worker->dead_mask + 1));
+			worker->dead_budgets = malloc(worker->dead_mask + 1);
+			if(!worker->dead_keys || !worker->dead_budgets){
+				printf("Failed to allocate memory for solver thread.\n");
+				exit(1);
+			}
+			memset(worker->dead_keys, 0xff, sizeof(unsigned int) * (worker->dead_mask + 1));
+			for(unsigned int i = 0; i <= old_mask; i++){
+				if(old_keys[i] == EMPTY_SLOT){continue;}
+				unsigned int s = (old_keys[i] * 2654435761u) & worker->dead_mask;
+				while(worker->dead_keys[s] != EMPTY_SLOT){
+					s = (s + 1) & worker->dead_mask;
+				}
+				worker->dead_keys[s] = old_keys[i];
+				worker->dead_budgets[s] = old_budgets[i];
+			}
+			free(old_keys);
+			free(old_budgets);
+		}
+		slot = (key * 2654435761u) & worker->dead_mask;
+		while(worker->dead_keys[slot] != EMPTY_SLOT && worker->dead_keys[slot] != key){
+			slot = (slot + 1) & worker->dead_mask;
+		}
+		if(worker->dead_keys[slot] == EMPTY_SLOT){
+			worker->dead_keys[slot] = key;
+			worker->dead_budgets[slot] = 0;
+			worker->dead_size++;
+		}
+	}
+	if(worker->dead_budgets[slot] < budget){
+		worker->dead_budgets[slot] = budget;
+	}
+	return 0;
+}
+
+// keep a solution of the parallel solver if it is no longer than the best one so far
+void record_chain(const int *chain, int length){
+	pthread_mutex_lock(&found_lock);
+	if(length < atomic_load(&best_depth)){
+		atomic_store(&best_depth, length);
+	}
+	if(length == atomic_load(&best_depth)){
+		if(num_found >= found_capacity){
+			found_capacity *= 2;
+			found_chains = realloc(found_chains, sizeof(int) * (NUM_LET + 1) * found_capacity);
+			if(!found_chains){
+				printf("Failed to allocate memory for solutions.\n");
+				exit(1);
+			}
+		}
+		int *found = &found_chains[num_found * (NUM_LET + 1)];
+		found[0] = length;
+		memcpy(found + 1, chain, sizeof(int) * length);
+		num_found++;
+	}
+	pthread_mutex_unlock(&found_lock);
 }
@@ -7,6 +7,7 @@
 
  ************************************************************************/
 
+#define _GNU_SOURCE // pipe2()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,14 +15,37 @@
 #include <sys/wait.h>
 #include <fcntl.h> 
 #include <ctype.h>
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include "wsh.h"
 
 // error message for any kind of invalid operation
 const char *error_message = "An error has occurred\n";
-ShellVar shell_vars[MAX_VARS];
-int num_vars = 0;
+var_table shell_vars;
+var_table env_vars;
 history_t history = {NULL, DEFAULT_HISTORY_SIZE, 0, 0, 0};
+history_file_t history_file = {.fd = -1};
+int profiling = 0;
+pid_t profile_pid;
+profile_entry *profile_table[PROFILE_TABLE_SIZE];
+struct rusage line_usage;
+int line_children = 0;
 int last_cmd_rc = 0;
+path_entry *path_cache[PATH_CACHE_SIZE];
+job_t jobs[MAX_JOBS];
+int job_control = 0;
+int job_order = 0;
+arg_list command_args; // reused by every command, its buffers only grow
+const char *builtin_commands[] = {"exit", "cd", "ls", "local", "export", "vars", "history", "hash",
+                                  "jobs", "wait", "fg", NULL};
 
 void init_path()
 {
@@ -30,17 +54,22 @@ void init_path()
 
 void interactive_mode()
 {
-    char command[MAX_COMMAND_LENGTH];
+    char *command = NULL; // getline() grows it for lines of any length
+    size_t command_size = 0;
+
+    // background jobs get their own process group so fg can hand them the terminal
+    job_control = isatty(STDIN_FILENO);
 
     while (1)
     {
+        report_done_jobs();
         printf("wsh> ");
         fflush(stdout);
 
         // get user input
-        if (fgets(command, MAX_COMMAND_LENGTH, stdin) == NULL)
+        if (getline(&command, &command_size, stdin) < 0)
         {
-            // fgets returns NULL on EOF, break the loop to exit
+            // getline returns -1 on EOF, break the loop to exit
             break;
         }
         // remove the newline character from the command
@@ -59,257 +88,620 @@ void interactive_mode()
         // execute the command
         execute_command(command);
     }
+    free(command);
+}
+
+// the whole batch file in memory: mapped if it is a regular file, read otherwise
+// (a pipe, /dev/stdin). *mapped tells which one to undo. NULL if it cannot be read.
+char *load_batch_file(int fd, size_t *size, int *mapped)
+{
+    struct stat st;
+    *size = 0;
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size == 0)
+        {
+            return malloc(1); // nothing to map
+        }
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            *size = st.st_size;
+            *mapped = 1;
+            return data;
+        }
+    }
+
+    size_t capacity = 4096;
+    char *data = malloc(capacity);
+    ssize_t n;
+    while ((n = read(fd, data + *size, capacity - *size)) > 0)
+    {
+        *size += n;
+        if (*size == capacity)
+        {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    if (n < 0)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// 1 if the line is "parallel N {" with a positive N, anything else runs as a command
+int is_parallel_header(const char *command, size_t length)
+{
+    size_t i = 0;
+    while (i < length && command[i] == ' ')
+    {
+        i++;
+    }
+    if (length - i < 9 || memcmp(command + i, "parallel ", 9) != 0)
+    {
+        return 0;
+    }
+    i += 9;
+    while (i < length && command[i] == ' ')
+    {
+        i++;
+    }
+    size_t digits = i;
+    int positive = 0;
+    for (; i < length && isdigit((unsigned char)command[i]); i++)
+    {
+        positive |= command[i] != '0';
+    }
+    if (i == digits || !positive || i == length || command[i] != ' ')
+    {
+        return 0;
+    }
+    while (i < length && command[i] == ' ')
+    {
+        i++;
+    }
+    if (i == length || command[i++] != '{')
+    {
+        return 0;
+    }
+    while (i < length && command[i] == ' ')
+    {
+        i++;
+    }
+    return i == length;
 }
 
+// the whole file is parsed before the first command runs, lines after exit are not read.
+// A parallel N { line takes the lines up to } into its block. The file is scanned in
+// place with memchr(), which goes through it a word or a vector at a time.
 void batch_mode(const char *batch_file)
 {
-    FILE *file = fopen(batch_file, "r");
-    if (file == NULL)
+    int fd = open(batch_file, O_RDONLY | O_CLOEXEC);
+    size_t size;
+    int mapped;
+    char *data = fd < 0 ? NULL : load_batch_file(fd, &size, &mapped);
+    if (data == NULL)
     {
         print_error("Error opening batch file");
         exit(1);
     }
+    close(fd);
+
+    parsed_line *script = NULL;
+    int count = 0;
+    int capacity = 0;
+    parsed_line *block = NULL; // the parallel block being read
+    int nested = 0; // blocks opened inside it
+    int invalid = 0; // it had a nested block
+    const char *end = data + size;
+    const char *next;
+    for (const char *command = data; command < end; command = next)
+    {
+        // the line without its newline character
+        const char *newline = memchr(command, '\n', end - command);
+        size_t length = (newline != NULL ? newline : end) - command;
+        next = newline != NULL ? newline + 1 : end;
 
-    char command[MAX_COMMAND_LENGTH];
-    while (fgets(command, MAX_COMMAND_LENGTH, file) != NULL)
-    {
-        // remove the newline character from the command
-        command[strcspn(command, "\n")] = 0;
         // ignore lines that are comments or empty
-        if (is_comment(command) || strlen(command) == 0)
+        size_t indent = 0;
+        while (indent < length && command[indent] == ' ')
+        {
+            indent++;
+        }
+        if (length == 0 || (indent < length && command[indent] == '#'))
+        {
+            continue;
+        }
+
+        int header = is_parallel_header(command, length);
+        if (block != NULL)
         {
+            // a nested block is invalid, the whole of it belongs to the outer one
+            if (header)
+            {
+                nested++;
+                invalid = 1;
+            }
+            else if (indent < length && command[indent] == '}')
+            {
+                if (nested > 0)
+                {
+                    nested--;
+                }
+                else
+                {
+                    block->block_closed = !invalid;
+                    block = NULL;
+                    invalid = 0;
+                }
+            }
+            else if (indent < length && nested == 0)
+            {
+                block->block = realloc(block->block, (block->block_size + 1) * sizeof(parsed_line));
+                parse_line(command, length, &block->block[block->block_size++]);
+            }
             continue;
         }
+
         // check if the command is 'exit'
-        if (strcmp(command, "exit") == 0)
+        if (length == 4 && memcmp(command, "exit", 4) == 0)
         {
             break;
         }
 
-        // execute the command
-        execute_command(command);
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            script = realloc(script, capacity * sizeof(parsed_line));
+        }
+        // parallel N { ... } takes the lines up to } with it, a } without a block
+        // is kept as an unclosed block to report it
+        if (header || (indent < length && command[indent] == '}'))
+        {
+            parsed_line *line = &script[count++];
+            *line = (parsed_line){0};
+            line->text = strndup(command, length);
+            line->is_parallel = 1;
+            block = header ? line : NULL;
+            continue;
+        }
+        parse_line(command, length, &script[count++]);
+    }
+    if (mapped)
+    {
+        munmap(data, size);
+    }
+    else
+    {
+        free(data);
+    }
+
+    // WSH_PROFILE: time every line, print_profile() sums them up at exit
+    if (getenv("WSH_PROFILE") != NULL)
+    {
+        profiling = 1;
+        profile_pid = getpid();
+        atexit(print_profile);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        run_line(&script[i]);
     }
 
-    fclose(file);
+    for (int i = 0; i < count; i++)
+    {
+        free_line(&script[i]);
+    }
+    free(script);
 }
 
 // 1: > | 2: < | 3: >> | 4: &> | 5: &>> | 6. 2>
-void handle_redirection(int redirect_type, char *filename)
+// open the file of a redirection (close-on-exec), *fd is -1 if there is none.
+// Returns 0 if the file cannot be opened.
+int open_redirection(int redirect_type, char *filename, int *fd)
 {
-    int fd;
-    if (redirect_type == 1) // output redirection
+    *fd = -1;
+    if (redirect_type == 0 || filename == NULL)
     {
-        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1)
-        {
-            perror("Failed to open output file");
-            exit(1);
-        }
-        dup2(fd, STDOUT_FILENO); // redirect stdout to file
-        close(fd);
+        return 1;
+    }
+
+    if (redirect_type == 2) // input redirection
+    {
+        *fd = open(filename, O_RDONLY | O_CLOEXEC);
+    }
+    else if (redirect_type == 3 || redirect_type == 5) // append stdout (and stderr)
+    {
+        *fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    else // redirect stdout and/or stderr
+    {
+        *fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
     }
-    else if (redirect_type == 2) // input redirection
+
+    if (*fd == -1)
     {
-        fd = open(filename, O_RDONLY);
-        if (fd == -1)
+        if (redirect_type == 2)
         {
             perror("Failed to open input file");
-            exit(1);
         }
-        dup2(fd, STDIN_FILENO); // redirect stdin to file
-        close(fd);
-    }
-    else if (redirect_type == 3) // append output redirection
-    {
-        fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd == -1)
+        else if (redirect_type == 6)
+        {
+            perror("Failed to open error file");
+        }
+        else
         {
             perror("Failed to open output file");
-            exit(1);
         }
-        dup2(fd, STDOUT_FILENO); // redirect stdout to file
-        close(fd);
+        return 0;
+    }
+    return 1;
+}
+
+// the standard streams a redirection replaces, -1 if it does not replace a second one
+void redirection_targets(int redirect_type, int *first, int *second)
+{
+    *second = -1;
+    if (redirect_type == 2)
+    {
+        *first = STDIN_FILENO;
+    }
+    else if (redirect_type == 6)
+    {
+        *first = STDERR_FILENO;
     }
-    else if (redirect_type == 4) // redirect stdout and stderr to the same file
+    else
     {
-        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1)
+        *first = STDOUT_FILENO;
+        if (redirect_type == 4 || redirect_type == 5)
         {
-            perror("Failed to open output file");
-            exit(1);
+            *second = STDERR_FILENO;
         }
-        dup2(fd, STDOUT_FILENO); // redirect stdout
-        dup2(fd, STDERR_FILENO); // redirect stderr
-        close(fd);
     }
-    else if (redirect_type == 5) // append stdout and stderr to the same file
+}
+
+// set up a redirection in a forked child, which must _exit() so a batch file shared
+// with the shell stays put
+void handle_redirection(int redirect_type, char *filename)
+{
+    int fd, first, second;
+    if (!open_redirection(redirect_type, filename, &fd))
+    {
+        _exit(1);
+    }
+    if (fd == -1)
+    {
+        return;
+    }
+    redirection_targets(redirect_type, &first, &second);
+    dup2(fd, first);
+    if (second != -1)
+    {
+        dup2(fd, second);
+    }
+    close(fd);
+}
+
+// point the fds a redirection replaces at redirect_fd while a built-in runs in the shell.
+// saved gets copies of the fds it replaced (-1 for one that was closed, -2 if there is no
+// redirection), restore_redirection() puts them back.
+void apply_redirection(int redirect_type, int redirect_fd, int saved[2])
+{
+    saved[0] = -2;
+    saved[1] = -2;
+    if (redirect_fd == -1)
+    {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    int targets[2];
+    redirection_targets(redirect_type, &targets[0], &targets[1]);
+    for (int i = 0; i < 2 && targets[i] != -1; i++)
+    {
+        saved[i] = fcntl(targets[i], F_DUPFD_CLOEXEC, 10);
+        dup2(redirect_fd, targets[i]);
+    }
+    close(redirect_fd);
+}
+
+void restore_redirection(int redirect_type, int saved[2])
+{
+    if (saved[0] == -2)
+    {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    int targets[2];
+    redirection_targets(redirect_type, &targets[0], &targets[1]);
+    for (int i = 0; i < 2 && targets[i] != -1; i++)
     {
-        fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd == -1)
+        if (saved[i] != -1)
         {
-            perror("Failed to open output file");
-            exit(1);
+            dup2(saved[i], targets[i]);
+            close(saved[i]);
+        }
+        else
+        {
+            close(targets[i]); // it was not open before
         }
-        dup2(fd, STDOUT_FILENO); // redirect stdout
-        dup2(fd, STDERR_FILENO); // redirect stderr
-        close(fd);
     }
-    else if (redirect_type == 6) // redirect stderr only
+}
+
+// start a command without fork(): posix_spawn() does not copy the shell's page tables.
+// in_fd/out_fd replace stdin/stdout (-1 to keep them), redirect_fd comes from
+// open_redirection(). All of them must be close-on-exec. pgid: -1 stays in the shell's
+// process group, 0 starts a new one, anything else joins it. Returns -1 if it did not start.
+pid_t spawn_command(const char *full_path, char *args[], int in_fd, int out_fd, int redirect_type, int redirect_fd,
+                    pid_t pgid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (redirect_fd != -1)
     {
-        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1)
+        int first, second;
+        redirection_targets(redirect_type, &first, &second);
+        posix_spawn_file_actions_adddup2(&actions, redirect_fd, first);
+        if (second != -1)
         {
-            perror("Failed to open error file");
-            exit(1);
+            posix_spawn_file_actions_adddup2(&actions, redirect_fd, second);
         }
-        dup2(fd, STDERR_FILENO); // redirect stderr to file
-        close(fd);
     }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    if (pgid != -1)
+    {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, full_path, &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0)
+    {
+        return -1;
+    }
+    return pid;
 }
 
-// parse redirection into a command string and set up redirect_type
-void parse_redirection(char *command, int *redirect_type, char **filename)
+// parse redirection of length characters of a command and set up redirect_type, filename
+// is a copy of the file name. Returns the length of the command before the redirection.
+size_t parse_redirection(const char *command, size_t length, int *redirect_type, char **filename)
 {
     // check for redirection symbols in the command
-    char *redir_pos = NULL;
+    const char *redir_pos = NULL;
+    size_t symbol_length = 0;
 
-    if (strstr(command, "2>"))
+    if ((redir_pos = memmem(command, length, "2>", 2)))
     {
         *redirect_type = 6; // redirect stderr only
-        *filename = strstr(command, "2>") + 2; // filename follows 2>
-        *strstr(command, "2>") = '\0'; // truncate command
+        symbol_length = 2; // filename follows 2>
     }
-    else if ((redir_pos = strstr(command, ">")))
+    else if ((redir_pos = memchr(command, '>', length)))
     {
         *redirect_type = 1; // output redirection
-        *filename = redir_pos + 1; // filename follows >
-        *redir_pos = '\0'; 
+        symbol_length = 1; // filename follows >
     }
-    else if ((redir_pos = strstr(command, "<")))
+    else if ((redir_pos = memchr(command, '<', length)))
     {
         *redirect_type = 2; // input redirection
-        *filename = redir_pos + 1; 
-        *redir_pos = '\0';
+        symbol_length = 1;
     }
-    else if ((redir_pos = strstr(command, ">>")))
+    else if ((redir_pos = memmem(command, length, ">>", 2)))
     {
         *redirect_type = 3; // append output redirection
-        *filename = redir_pos + 2;
-        *redir_pos = '\0'; 
+        symbol_length = 2;
     }
-    else if ((redir_pos = strstr(command, "&>")))
+    else if ((redir_pos = memmem(command, length, "&>", 2)))
     {
         *redirect_type = 4; // redirect both stdout and stderr
-        *filename = redir_pos + 2; 
-        *redir_pos = '\0';
+        symbol_length = 2;
     }
-    else if ((redir_pos = strstr(command, "&>>")))
+    else if ((redir_pos = memmem(command, length, "&>>", 3)))
     {
         *redirect_type = 5; // append both stdout and stderr
-        *filename = redir_pos + 3; 
-        *redir_pos = '\0'; 
+        symbol_length = 3;
+    }
+    if (redir_pos == NULL)
+    {
+        return length;
     }
 
     // remove leading spaces
-    if (filename && *filename)
+    const char *name = redir_pos + symbol_length;
+    const char *end = command + length;
+    while (name < end && *name == ' ')
+    {
+        name++;
+    }
+    *filename = strndup(name, end - name);
+    return redir_pos - command; // truncate command
+}
+
+// djb2 over the first length characters of a variable name
+unsigned int hash_name(const char *name, size_t length)
+{
+    unsigned int hash = 5381;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = hash * 33 + (unsigned char)name[i];
+    }
+    return hash;
+}
+
+// find a variable by a name that does not have to be null-terminated, NULL if it is not set
+ShellVar *find_var(var_table *table, const char *name, size_t length)
+{
+    if (table->index_size == 0)
+    {
+        return NULL;
+    }
+    unsigned int hash = hash_name(name, length);
+    for (unsigned int slot = hash & (table->index_size - 1); table->index[slot] != 0;
+         slot = (slot + 1) & (table->index_size - 1))
     {
-        while (**filename == ' ')
+        ShellVar *var = &table->vars[table->index[slot] - 1];
+        if (var->hash == hash && strncmp(var->name, name, length) == 0 && var->name[length] == '\0')
         {
-            (*filename)++;
+            return var;
         }
     }
+    return NULL;
 }
 
-// getter for a shell variable value
-const char *get_shell_var(const char *varname)
+// set a variable, a new one goes at the end of the table's order
+void put_var(var_table *table, const char *name, const char *value)
 {
-    for (int i = 0; i < num_vars; i++)
+    ShellVar *var = find_var(table, name, strlen(name));
+    if (var != NULL)
+    {
+        // update existing variable
+        free(var->value);
+        var->value = strdup(value);
+        return;
+    }
+
+    if (table->count == table->capacity)
+    {
+        table->capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+        table->vars = realloc(table->vars, table->capacity * sizeof(ShellVar));
+    }
+    // the index stays at most half full, so probe chains are short
+    if (2 * (table->count + 1) > table->index_size)
     {
-        if (strcmp(shell_vars[i].name, varname) == 0)
+        free(table->index);
+        table->index_size = table->index_size == 0 ? 32 : table->index_size * 2;
+        table->index = calloc(table->index_size, sizeof(int));
+        for (int i = 0; i < table->count; i++)
         {
-            return shell_vars[i].value;
+            unsigned int slot = table->vars[i].hash & (table->index_size - 1);
+            while (table->index[slot] != 0)
+            {
+                slot = (slot + 1) & (table->index_size - 1);
+            }
+            table->index[slot] = i + 1;
         }
     }
-    return ""; // if variable doesn't exist, return empty string
+
+    var = &table->vars[table->count++];
+    var->name = strdup(name);
+    var->value = strdup(value);
+    var->hash = hash_name(name, strlen(name));
+    unsigned int slot = var->hash & (table->index_size - 1);
+    while (table->index[slot] != 0)
+    {
+        slot = (slot + 1) & (table->index_size - 1);
+    }
+    table->index[slot] = table->count;
 }
 
-// setter for a shell variable
-void set_shell_var(const char *varname, const char *value)
+// copy the environment into env_vars, so $VAR does not have to go through getenv()
+void init_env_vars()
 {
-    for (int i = 0; i < num_vars; i++)
+    for (char **env = environ; *env != NULL; env++)
     {
-        if (strcmp(shell_vars[i].name, varname) == 0)
+        char *equal_sign = strchr(*env, '=');
+        if (equal_sign != NULL)
         {
-            // update existing variable
-            strcpy(shell_vars[i].value, value);
-            return;
+            char *name = strndup(*env, equal_sign - *env);
+            put_var(&env_vars, name, equal_sign + 1);
+            free(name);
         }
     }
-    // add new variable
-    if (num_vars < MAX_VARS)
+}
+
+// getter for a shell variable value
+const char *get_shell_var(const char *varname)
+{
+    ShellVar *var = find_var(&shell_vars, varname, strlen(varname));
+    return var != NULL ? var->value : ""; // if variable doesn't exist, return empty string
+}
+
+// setter for a shell variable
+void set_shell_var(const char *varname, const char *value)
+{
+    put_var(&shell_vars, varname, value);
+}
+
+// the value of the variable referenced at *read_ptr (just after a $), environment
+// variables first, "" if it is not set. *read_ptr moves past the name.
+// NULL if no name follows, the $ is a literal then.
+const char *variable_reference(const char **read_ptr)
+{
+    const char *varname = *read_ptr;
+    if (!isalpha(*varname) && *varname != '_')
+    {
+        return NULL;
+    }
+    const char *end = varname;
+    while (isalnum(*end) || *end == '_')
     {
-        strcpy(shell_vars[num_vars].name, varname);
-        strcpy(shell_vars[num_vars].value, value);
-        num_vars++;
+        end++;
     }
-    else
+    *read_ptr = end;
+
+    // the name is looked up where it is in the command
+    ShellVar *var = find_var(&env_vars, varname, end - varname);
+    if (var == NULL)
     {
-        fprintf(stderr, "Error: Maximum number of shell variables reached.\n");
+        var = find_var(&shell_vars, varname, end - varname);
     }
+    return var != NULL ? var->value : "";
 }
 
-// expand var after $ to value
-void expand_variables(char *command)
+// expand var after $ to value, returns a new string the caller frees
+char *expand_variables(const char *command)
 {
-    char expanded_command[MAX_COMMAND_LENGTH];
-    char *read_ptr = command;
-    char *write_ptr = expanded_command;
+    size_t size = 0;
+    size_t capacity = strlen(command) + 1;
+    char *expanded = malloc(capacity);
+    const char *read_ptr = command;
     while (*read_ptr)
     {
-        if (*read_ptr == '$')
+        // a plain character, or the value of a variable
+        const char *value = read_ptr++;
+        size_t length = 1;
+        if (*value == '$')
         {
-            read_ptr++;
-            char varname[MAX_VAR_LENGTH];
-            char *var_ptr = varname;
-
-            // collect valid variable name characters
-            if (isalpha(*read_ptr) || *read_ptr == '_')
-            {
-                while (*read_ptr && (isalnum(*read_ptr) || *read_ptr == '_'))
-                {
-                    *var_ptr++ = *read_ptr++;
-                }
-                *var_ptr = '\0';
-
-                // lookup variable value
-                const char *var_value = getenv(varname);
-                if (var_value == NULL)
-                {
-                    var_value = get_shell_var(varname);
-                }
-
-                // replace with variable value
-                if (var_value)
-                {
-                    while (*var_value)
-                    {
-                        *write_ptr++ = *var_value++;
-                    }
-                }
-            }
-            else
+            const char *var_value = variable_reference(&read_ptr);
+            if (var_value != NULL)
             {
-                // if not a valid variable name, treat '$' as a literal
-                *write_ptr++ = '$';
+                value = var_value;
+                length = strlen(value);
             }
+            // if not a valid variable name, treat '$' as a literal
         }
-        else
+
+        if (size + length + 1 > capacity)
         {
-            *write_ptr++ = *read_ptr++;
+            capacity = 2 * (size + length + 1);
+            expanded = realloc(expanded, capacity);
         }
+        memcpy(expanded + size, value, length);
+        size += length;
     }
-    *write_ptr = '\0';
-    strcpy(command, expanded_command); // replace the original command
+    expanded[size] = '\0';
+    return expanded;
 }
 
 // local command handler for setting shell variables
@@ -354,8 +746,9 @@ void handle_local_command(char *command)
     if (varname != NULL && value != NULL)
     {
         // expand variables in value (e.g., local a=$b)
-        expand_variables(value);
-        set_shell_var(varname, value);
+        char *expanded = expand_variables(value);
+        set_shell_var(varname, expanded);
+        free(expanded);
         last_cmd_rc = 0;
     }
     else if (varname != NULL && value == NULL)
@@ -376,6 +769,11 @@ void handle_export_command(char *command)
     {
         // set environment variable
         setenv(varname, value, 1); // 1 means overwrite existing value
+        put_var(&env_vars, varname, value);
+        if (strcmp(varname, "PATH") == 0)
+        {
+            clear_path_cache(); // commands may resolve differently now
+        }
         last_cmd_rc = 0;
     }
     else if (varname != NULL && value == NULL)
@@ -388,9 +786,9 @@ void handle_export_command(char *command)
 // handle the vars command (display shell variables)
 void handle_vars_command()
 {
-    for (int i = 0; i < num_vars; i++)
+    for (int i = 0; i < shell_vars.count; i++)
     {
-        printf("%s=%s\n", shell_vars[i].name, shell_vars[i].value);
+        printf("%s=%s\n", shell_vars.vars[i].name, shell_vars.vars[i].value);
     }
     last_cmd_rc = 0;
 }
@@ -410,13 +808,23 @@ void insert_history(const char *command)
         return; 
     }
 
+    if (add_history(command, strlen(command)))
+    {
+        append_history_file(command);
+    }
+}
+
+// add the first length characters of command to the history buffer, 0 if it repeats the last one
+int add_history(const char *command, size_t length)
+{
     // prevent consecutive duplicate commands
     if (history.count > 0)
     {
         int last_index = (history.end - 1 + history.capacity) % history.capacity;
-        if (strcmp(history.commands[last_index], command) == 0)
+        const char *last = history.commands[last_index];
+        if (strncmp(last, command, length) == 0 && last[length] == '\0')
         {
-            return;
+            return 0;
         }
     }
 
@@ -424,17 +832,18 @@ void insert_history(const char *command)
     if (history.count == history.capacity)
     {
         free(history.commands[history.start]);
-        history.commands[history.start] = strdup(command);
+        history.commands[history.start] = strndup(command, length);
         history.start = (history.start + 1) % history.capacity;
         history.end = (history.end + 1) % history.capacity;
     }
     else
     {
         // add the new command to the end of the circular buffer
-        history.commands[history.end] = strdup(command);
+        history.commands[history.end] = strndup(command, length);
         history.end = (history.end + 1) % history.capacity;
         history.count++;
     }
+    return 1;
 }
 
 void print_history()
@@ -505,345 +914,1826 @@ void set_history_size(int new_size)
     last_cmd_rc = 0;
 }
 
-// built-in cd command handler
-void handle_cd_command(char *args[])
+// the history file is $WSH_HISTFILE, or ~/.wsh_history when a user types the commands.
+// Batch mode and piped input keep no history file unless WSH_HISTFILE asks for one.
+void init_history_file(int interactive)
 {
-    if (args[1] == NULL || args[2] != NULL)
+    const char *path = getenv("WSH_HISTFILE");
+    const char *home = getenv("HOME");
+    if (path != NULL && *path != '\0')
     {
-        fprintf(stderr, "cd: wrong number of arguments\n");
-        last_cmd_rc = 1;
-        return;
+        history_file.path = strdup(path);
     }
-    if (chdir(args[1]) != 0)
+    else if (interactive && home != NULL)
     {
-        perror("cd failed");
-        last_cmd_rc = 1;
+        size_t length = strlen(home) + strlen("/.wsh_history") + 1;
+        history_file.path = malloc(length);
+        snprintf(history_file.path, length, "%s/.wsh_history", home);
     }
-    else
+}
+
+// start the history with the last entries of the history file, so history and history N
+// go on from the earlier sessions
+void load_history_file()
+{
+    if (!refresh_history_index())
     {
-        last_cmd_rc = 0;
+        return;
+    }
+    int first = history_file.count > history.capacity ? history_file.count - history.capacity : 0;
+    for (int i = first; i < history_file.count; i++)
+    {
+        add_history(history_file.data + history_file.entries[i], history_entry_length(i));
     }
 }
 
-// helper compare function for qsort (alphabetical order)
-int compare_filenames(const void *a, const void *b)
+// open the history file on first use, 0 if there is none
+int open_history_file()
 {
-    const char *file_a = *(const char **)a;
-    const char *file_b = *(const char **)b;
-    return strcmp(file_a, file_b);
+    if (history_file.fd == -1 && history_file.path != NULL)
+    {
+        history_file.fd = open(history_file.path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (history_file.fd == -1)
+        {
+            free(history_file.path);
+            history_file.path = NULL; // don't try again for every command
+        }
+    }
+    return history_file.fd != -1;
 }
 
-void handle_ls_command()
+// add a command to the history file. The lock keeps lines from concurrent sessions
+// whole, O_APPEND puts each one at the end of the file wherever the others left it.
+void append_history_file(const char *command)
 {
-    DIR *dir;
-    struct dirent *entry;
-    char *filenames[1024]; // array to store file names, size will adjust later
-    int count = 0;
-
-    dir = opendir(".");
-    if (!dir)
+    if (!open_history_file())
     {
-        perror("ls");
-        last_cmd_rc = 1;
         return;
     }
+    size_t length = strlen(command);
+    char *line = malloc(length + 1);
+    memcpy(line, command, length);
+    line[length] = '\n';
 
-    // collect filenames from the directory
-    while ((entry = readdir(dir)) != NULL)
+    flock(history_file.fd, LOCK_EX);
+    for (size_t done = 0; done < length + 1; )
     {
-        // ignore hidden files (starting with .)
-        if (entry->d_name[0] != '.')
-        {                                             
-            filenames[count] = strdup(entry->d_name); // duplicate the name for sorting
-            count++;
+        ssize_t written = write(history_file.fd, line + done, length + 1 - done);
+        if (written <= 0)
+        {
+            break;
         }
+        done += written;
     }
-    closedir(dir);
+    flock(history_file.fd, LOCK_UN);
+    free(line);
+}
 
-    // sort the filenames alphabetically
-    qsort(filenames, count, sizeof(char *), compare_filenames);
+// bucket of the trigram at text in a block signature
+unsigned int history_trigram(const char *text)
+{
+    unsigned int trigram = (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+    return (trigram * 2654435761u) >> (32 - HISTORY_BITS_LOG2);
+}
+
+// length of entry i of the history file, without its newline
+size_t history_entry_length(int i)
+{
+    size_t end = i + 1 < history_file.count ? history_file.entries[i + 1] : history_file.indexed;
+    return end - history_file.entries[i] - 1;
+}
+
+// map the history file again if it changed, and index the entries added since the last
+// time: their offsets, and the trigrams of every HISTORY_BLOCK of them in one signature.
+// Another session may be writing a line, that one is left for the next time. Returns 0 if
+// there is no history file.
+int refresh_history_index()
+{
+    if (!open_history_file())
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(history_file.fd, &st) != 0)
+    {
+        return 0;
+    }
+    size_t size = st.st_size;
+    if (size == history_file.size)
+    {
+        return 1;
+    }
+
+    if (history_file.data != NULL)
+    {
+        munmap(history_file.data, history_file.size);
+        history_file.data = NULL;
+    }
+    if (size < history_file.indexed)
+    {
+        // the file was cut, index it from the start
+        history_file.count = 0;
+        history_file.indexed = 0;
+    }
+    history_file.size = size;
+    if (size == 0)
+    {
+        return 1;
+    }
+    history_file.data = mmap(NULL, size, PROT_READ, MAP_SHARED, history_file.fd, 0);
+    if (history_file.data == MAP_FAILED)
+    {
+        history_file.data = NULL;
+        history_file.size = 0;
+        return 0;
+    }
+
+    // whole lines only, a line without its newline yet is indexed next time
+    const char *data = history_file.data;
+    const char *newline;
+    while ((newline = memchr(data + history_file.indexed, '\n', size - history_file.indexed)) != NULL)
+    {
+        if (history_file.count == history_file.capacity)
+        {
+            history_file.capacity = history_file.capacity == 0 ? 1024 : 2 * history_file.capacity;
+            history_file.entries = realloc(history_file.entries, history_file.capacity * sizeof(size_t));
+            history_file.blocks = realloc(history_file.blocks,
+                                          history_file.capacity / HISTORY_BLOCK * sizeof(history_block));
+        }
+        int i = history_file.count++;
+        history_block *block = &history_file.blocks[i / HISTORY_BLOCK];
+        if (i % HISTORY_BLOCK == 0)
+        {
+            memset(block, 0, sizeof(history_block));
+        }
+        const char *entry = data + history_file.indexed;
+        for (const char *p = entry; p + 3 <= newline; p++)
+        {
+            unsigned int bit = history_trigram(p);
+            block->bits[bit / 64] |= 1ULL << (bit % 64);
+        }
+        history_file.entries[i] = history_file.indexed;
+        history_file.indexed = newline + 1 - data;
+    }
+    return 1;
+}
+
+// history search text: the entries of the history file that contain text, newest first.
+// Blocks whose signature lacks one of the trigrams of text are skipped without reading them.
+void handle_history_search(const char *text)
+{
+    if (!refresh_history_index())
+    {
+        fprintf(stderr, "Error: No history file\n");
+        last_cmd_rc = 1;
+        return;
+    }
+
+    size_t length = strlen(text);
+    history_block query = {{0}};
+    for (size_t i = 0; i + 3 <= length; i++)
+    {
+        unsigned int bit = history_trigram(text + i);
+        query.bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+
+    last_cmd_rc = 1; // until something matches
+    for (int b = (history_file.count - 1) / HISTORY_BLOCK; b >= 0 && history_file.count > 0; b--)
+    {
+        int candidate = 1;
+        for (int w = 0; w < HISTORY_BITS / 64 && candidate; w++)
+        {
+            candidate = (history_file.blocks[b].bits[w] & query.bits[w]) == query.bits[w];
+        }
+        if (!candidate)
+        {
+            continue;
+        }
+
+        int last = b * HISTORY_BLOCK + HISTORY_BLOCK - 1;
+        for (int i = last < history_file.count ? last : history_file.count - 1; i >= b * HISTORY_BLOCK; i--)
+        {
+            const char *entry = history_file.data + history_file.entries[i];
+            size_t entry_length = history_entry_length(i);
+            if (memmem(entry, entry_length, text, length) != NULL)
+            {
+                printf("%d) %.*s\n", i + 1, (int)entry_length, entry);
+                last_cmd_rc = 0;
+            }
+        }
+    }
+}
+
+// built-in cd command handler
+void handle_cd_command(char *args[])
+{
+    if (args[1] == NULL || args[2] != NULL)
+    {
+        fprintf(stderr, "cd: wrong number of arguments\n");
+        last_cmd_rc = 1;
+        return;
+    }
+    if (chdir(args[1]) != 0)
+    {
+        perror("cd failed");
+        last_cmd_rc = 1;
+    }
+    else
+    {
+        last_cmd_rc = 0;
+    }
+}
+
+// MSD radix sort of names on their bytes from depth on, the order strcmp() gives.
+// Buckets of a few names are finished with an insertion sort.
+void radix_sort_names(char **names, char **scratch, int count, size_t depth)
+{
+    if (count < 32)
+    {
+        for (int i = 1; i < count; i++)
+        {
+            char *name = names[i];
+            int j = i;
+            while (j > 0 && strcmp(names[j - 1] + depth, name + depth) > 0)
+            {
+                names[j] = names[j - 1];
+                j--;
+            }
+            names[j] = name;
+        }
+        return;
+    }
+
+    // bucket 0 holds the names that end at depth, they are all the same from here
+    int start[257] = {0};
+    for (int i = 0; i < count; i++)
+    {
+        start[(unsigned char)names[i][depth] + 1]++;
+    }
+    for (int c = 1; c < 257; c++)
+    {
+        start[c] += start[c - 1];
+    }
+    int next[256];
+    memcpy(next, start, sizeof(next));
+    for (int i = 0; i < count; i++)
+    {
+        scratch[next[(unsigned char)names[i][depth]]++] = names[i];
+    }
+    memcpy(names, scratch, count * sizeof(char *));
+
+    for (int c = 1; c < 256; c++)
+    {
+        if (start[c + 1] - start[c] > 1)
+        {
+            radix_sort_names(names + start[c], scratch, start[c + 1] - start[c], depth + 1);
+        }
+    }
+}
+
+// write all of buffer to stdout, after whatever printf() still has buffered
+void write_output(const char *buffer, size_t size)
+{
+    fflush(stdout);
+    for (size_t done = 0; done < size; )
+    {
+        ssize_t written = write(STDOUT_FILENO, buffer + done, size - done);
+        if (written <= 0)
+        {
+            return;
+        }
+        done += written;
+    }
+}
+
+// ls: the names in the current directory, hidden ones left out, sorted.
+// ls -U: in directory order, printed as they are read, without keeping them.
+// The directory is read with getdents64() LS_BUFFER_SIZE bytes at a time, the names
+// go into one buffer and out with a single write().
+void handle_ls_command(char *args[])
+{
+    int sorted = 1;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-U") == 0)
+        {
+            sorted = 0;
+        }
+    }
+
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("ls");
+        last_cmd_rc = 1;
+        return;
+    }
+
+    char *entries = malloc(LS_BUFFER_SIZE);
+    char *text = NULL; // every name followed by \n
+    size_t text_size = 0;
+    size_t text_capacity = 0;
+    int count = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, entries, LS_BUFFER_SIZE)) > 0)
+    {
+        for (ssize_t offset = 0; offset < n; )
+        {
+            struct dirent64 *entry = (struct dirent64 *)(entries + offset);
+            offset += entry->d_reclen;
+            // ignore hidden files (starting with .)
+            if (entry->d_name[0] == '.')
+            {
+                continue;
+            }
+            size_t length = strlen(entry->d_name);
+            if (text_size + length + 1 > text_capacity)
+            {
+                text_capacity = text_capacity == 0 ? LS_BUFFER_SIZE : 2 * text_capacity;
+                text = realloc(text, text_capacity);
+            }
+            memcpy(text + text_size, entry->d_name, length);
+            text_size += length;
+            text[text_size++] = '\n';
+            count++;
+        }
+        if (!sorted)
+        {
+            write_output(text, text_size);
+            text_size = 0;
+        }
+    }
+    close(fd);
+    free(entries);
+    if (n < 0)
+    {
+        perror("ls");
+        free(text);
+        last_cmd_rc = 1;
+        return;
+    }
+
+    if (sorted && count > 0)
+    {
+        // the second half of names is scratch space for the sort
+        char **names = malloc(2 * count * sizeof(char *));
+        char *name = text;
+        for (int i = 0; i < count; i++)
+        {
+            names[i] = name;
+            name = (char *)memchr(name, '\n', text + text_size - name) + 1;
+            name[-1] = '\0';
+        }
+        radix_sort_names(names, names + count, count, 0);
+
+        char *output = malloc(text_size);
+        size_t output_size = 0;
+        for (int i = 0; i < count; i++)
+        {
+            size_t length = strlen(names[i]);
+            memcpy(output + output_size, names[i], length);
+            output_size += length;
+            output[output_size++] = '\n';
+        }
+        write_output(output, output_size);
+        free(output);
+        free(names);
+    }
+    free(text);
+    last_cmd_rc = 0;
+}
+
+// print a specific error message to stderr
+void print_error(const char *message)
+{
+    fprintf(stderr, "%s\n", message);
+}
+
+// helper function to check if a line starts with # 
+int is_comment(char *line)
+{
+    // remove leading spaces
+    while (*line == ' ')
+    {
+        line++;
+    }
+    // check if the line starts with '#'
+    return (*line == '#');
+}
+
+// string hash for the command hash table
+unsigned int hash_command(const char *command)
+{
+    unsigned int hash = 5381;
+    while (*command)
+    {
+        hash = hash * 33 + (unsigned char)*command++;
+    }
+    return hash % PATH_CACHE_SIZE;
+}
+
+// look up a command resolved earlier, returns 0 if it is not cached
+int lookup_path_cache(const char *command, char *full_path)
+{
+    for (path_entry *entry = path_cache[hash_command(command)]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->command, command) == 0)
+        {
+            entry->hits++;
+            snprintf(full_path, MAX_PATH_LENGTH, "%s", entry->path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// remember where a command was found in PATH
+void insert_path_cache(const char *command, const char *full_path)
+{
+    unsigned int bucket = hash_command(command);
+    path_entry *entry = malloc(sizeof(path_entry));
+    if (entry == NULL)
+    {
+        return; // the cache is only an optimization
+    }
+    entry->command = strdup(command);
+    entry->path = strdup(full_path);
+    entry->hits = 0;
+    entry->next = path_cache[bucket];
+    path_cache[bucket] = entry;
+}
+
+// forget all resolved commands, e.g. because PATH changed
+void clear_path_cache()
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++)
+    {
+        path_entry *entry = path_cache[i];
+        while (entry != NULL)
+        {
+            path_entry *next = entry->next;
+            free(entry->command);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_cache[i] = NULL;
+    }
+}
+
+// hash: list the cached commands | hash -r: clear the cache | hash cmd...: look up and cache
+void handle_hash_command(char *args[])
+{
+    last_cmd_rc = 0;
+    if (args[1] == NULL)
+    {
+        printf("hits\tcommand\tpath\n");
+        for (int i = 0; i < PATH_CACHE_SIZE; i++)
+        {
+            for (path_entry *entry = path_cache[i]; entry != NULL; entry = entry->next)
+            {
+                printf("%4d\t%s\t%s\n", entry->hits, entry->command, entry->path);
+            }
+        }
+        return;
+    }
+    if (strcmp(args[1], "-r") == 0 && args[2] == NULL)
+    {
+        clear_path_cache();
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char full_path[MAX_PATH_LENGTH];
+        if (strchr(args[i], '/') != NULL || is_builtin_command(args[i]) ||
+            !find_command_in_path(args[i], full_path))
+        {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            last_cmd_rc = 1;
+        }
+    }
+}
+
+// cut a trailing & (not the one of &> or &>>) off length characters of a command,
+// returns 1 if there was one
+int parse_background(const char *command, size_t *length_ptr)
+{
+    size_t length = *length_ptr;
+    while (length > 0 && command[length - 1] == ' ')
+    {
+        length--;
+    }
+    if (length == 0 || command[length - 1] != '&')
+    {
+        return 0;
+    }
+    length--;
+    while (length > 0 && command[length - 1] == ' ')
+    {
+        length--;
+    }
+    *length_ptr = length;
+    return 1;
+}
+
+// install the SIGCHLD handler that reaps background jobs
+void init_jobs()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = reap_jobs;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP; // fgets() and waitpid() go on after it
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+// SIGCHLD handler: collect the processes of background jobs that are done. Only pids
+// in the job table are waited for, foreground commands are left to their own waitpid().
+void reap_jobs(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        job_t *job = &jobs[i];
+        if (job->id == 0)
+        {
+            continue;
+        }
+        for (int n = 0; n < job->num_pids; n++)
+        {
+            int status;
+            if (job->pids[n] > 0 && waitpid(job->pids[n], &status, WNOHANG) == job->pids[n])
+            {
+                job->pids[n] = 0;
+                job->running--;
+                if (n == job->num_pids - 1)
+                {
+                    job->rc = child_status(status);
+                }
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+// keep the job table away from reap_jobs() until the old mask is restored
+void block_sigchld(sigset_t *old)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old);
+}
+
+// track the processes of a background command (pids of -1 did not start).
+// Returns 0 if the table is full, the caller waits for them in the foreground then.
+int add_job(pid_t pids[], int num_pids, pid_t pgid, const char *command)
+{
+    sigset_t old;
+    block_sigchld(&old);
+
+    // done jobs nobody asked about yet are given up before the table is full
+    job_t *job = NULL;
+    for (int pass = 0; pass < 2 && job == NULL; pass++)
+    {
+        for (int i = 0; i < MAX_JOBS; i++)
+        {
+            if (jobs[i].id == 0 || (pass == 1 && jobs[i].running == 0))
+            {
+                job = &jobs[i];
+                job->id = i + 1;
+                break;
+            }
+        }
+    }
+    if (job == NULL)
+    {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        fprintf(stderr, "Error: Too many background jobs\n");
+        return 0;
+    }
+
+    job->order = ++job_order;
+    job->pgid = pgid;
+    job->num_pids = num_pids;
+    job->running = 0;
+    job->rc = 1; // unless the last process exits with something else
+    for (int n = 0; n < num_pids; n++)
+    {
+        job->pids[n] = pids[n];
+        job->running += pids[n] > 0;
+    }
+    free(job->command); // left from the job that had the slot before
+    job->command = strdup(command);
+
+    // processes that exited before they were in the table sent their SIGCHLD already
+    reap_jobs(SIGCHLD);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 1;
+}
+
+// "%n" or "n" is job n, no spec is the job started last. NULL if there is no such job.
+job_t *find_job(const char *spec)
+{
+    job_t *found = NULL;
+    int id = 0;
+    if (spec != NULL)
+    {
+        id = atoi(spec[0] == '%' ? spec + 1 : spec);
+        if (id <= 0)
+        {
+            return NULL;
+        }
+    }
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (jobs[i].id == 0 || (id != 0 && jobs[i].id != id))
+        {
+            continue;
+        }
+        if (found == NULL || jobs[i].order > found->order)
+        {
+            found = &jobs[i];
+        }
+    }
+    return found;
+}
+
+// sleep until every process of the job is reaped
+void wait_for_job(job_t *job)
+{
+    sigset_t old;
+    block_sigchld(&old);
+    while (job->running > 0)
+    {
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// make pgid the foreground process group of the terminal
+void give_terminal(pid_t pgid)
+{
+    // a shell that is not in the foreground group would be stopped by SIGTTOU
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// print the jobs that are done since the last prompt and forget them
+void report_done_jobs()
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (jobs[i].id != 0 && jobs[i].running == 0)
+        {
+            printf("[%d] Done\t%s\n", jobs[i].id, jobs[i].command);
+            jobs[i].id = 0;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// jobs: list the background jobs, the ones that are done are listed one last time
+void handle_jobs_command()
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (jobs[i].id == 0)
+        {
+            continue;
+        }
+        printf("[%d] %s\t%s &\n", jobs[i].id, jobs[i].running > 0 ? "Running" : "Done", jobs[i].command);
+        if (jobs[i].running == 0)
+        {
+            jobs[i].id = 0;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    last_cmd_rc = 0;
+}
+
+// wait: wait for every job, rc 0 | wait job...: wait for those, rc of the last one
+void handle_wait_command(char *args[])
+{
+    last_cmd_rc = 0;
+    if (args[1] == NULL)
+    {
+        for (int i = 0; i < MAX_JOBS; i++)
+        {
+            if (jobs[i].id != 0)
+            {
+                wait_for_job(&jobs[i]);
+                jobs[i].id = 0;
+            }
+        }
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        job_t *job = find_job(args[i]);
+        if (job == NULL)
+        {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            last_cmd_rc = 1;
+            continue;
+        }
+        wait_for_job(job);
+        last_cmd_rc = job->rc;
+        job->id = 0;
+    }
+}
+
+// fg [job]: bring a job (the last one by default) to the foreground and wait for it
+void handle_fg_command(char *args[])
+{
+    job_t *job = find_job(args[1]);
+    if (job == NULL)
+    {
+        fprintf(stderr, "fg: %s: no such job\n", args[1] != NULL ? args[1] : "current");
+        last_cmd_rc = 1;
+        return;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+
+    int terminal = job_control && job->pgid > 0;
+    if (terminal)
+    {
+        give_terminal(job->pgid);
+    }
+    if (job->pgid > 0)
+    {
+        kill(-job->pgid, SIGCONT); // it may have stopped reading from the terminal
+    }
+    wait_for_job(job);
+    if (terminal)
+    {
+        give_terminal(getpgrp());
+    }
+    last_cmd_rc = job->rc;
+    job->id = 0;
+}
+
+// helper function to search for the executable in directories listed in PATH.
+// Commands found before come from path_cache without touching the file system.
+int find_command_in_path(const char *command, char *full_path)
+{
+    if (lookup_path_cache(command, full_path))
+    {
+        return 1;
+    }
+
+    char *path_env = getenv("PATH");
+    if (path_env == NULL)
+    {
+        return 0;
+    }
+    char *path = strdup(path_env); // duplicate the PATH string for manipulation
+    char *saveptr; // for strtok_r
+    char *dir = strtok_r(path, ":", &saveptr); // split PATH by :
+    int relative = 0; // a directory looked at depends on the working directory
+
+    // try each directory in PATH
+    while (dir != NULL)
+    {
+        relative |= dir[0] != '/';
+        snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", dir, command);
+        if (access(full_path, X_OK) == 0)
+        {
+            free(path);
+            if (!relative)
+            {
+                insert_path_cache(command, full_path); // another directory could find another one after cd
+            }
+            return 1; // found the command and it's executable
+        }
+        dir = strtok_r(NULL, ":", &saveptr);
+    }
+
+    free(path);
+    return 0; // command not found in any PATH directory
+}
+
+// check if a command is a built-in command
+int is_builtin_command(const char *cmd)
+{
+    // compare the first token where it is
+    while (*cmd == ' ')
+    {
+        cmd++;
+    }
+    size_t length = strcspn(cmd, " ");
+    for (int i = 0; builtin_commands[i] != NULL; i++)
+    {
+        if (strncmp(cmd, builtin_commands[i], length) == 0 && builtin_commands[i][length] == '\0')
+        {
+            return length > 0;
+        }
+    }
+    return 0;
+}
+
+// run a built-in command, returns 0 if args[0] is not one
+int execute_builtin(char *args[])
+{
+    // check if this is the exit command
+    if (strcmp(args[0], "exit") == 0)
+    {
+        if (args[1] != NULL)
+        {
+            fprintf(stderr, "Error: exit does not take any arguments\n");
+            last_cmd_rc = 255; 
+        }
+        else
+        {
+            exit(last_cmd_rc);
+        }
+        return 1;
+    }
+
+    // check if this is a local commadn
+    if (strcmp(args[0], "local") == 0 && args[1] != NULL)
+    {
+        handle_local_command(args[1]); 
+        return 1;
+    }
+
+    // check if this is an export command
+    if (strcmp(args[0], "export") == 0 && args[1] != NULL)
+    {
+        handle_export_command(args[1]);
+        return 1;
+    }
+
+    // check if this is the vars command
+    if (strcmp(args[0], "vars") == 0)
+    {
+        handle_vars_command();
+        return 1;
+    }
+
+    // check if this is a history command
+    if (strcmp(args[0], "history") == 0)
+    {
+        if (args[1] == NULL)
+        {
+            print_history();
+        }
+        else if (strcmp(args[1], "set") == 0 && args[2] != NULL)
+        {
+            set_history_size(atoi(args[2]));
+        }
+        else if (strcmp(args[1], "search") == 0 && args[2] != NULL)
+        {
+            // the words after search, as one string
+            size_t length = 0;
+            for (int i = 2; args[i] != NULL; i++)
+            {
+                length += strlen(args[i]) + 1;
+            }
+            char *text = malloc(length);
+            char *end = text;
+            for (int i = 2; args[i] != NULL; i++)
+            {
+                if (end != text)
+                {
+                    *end++ = ' ';
+                }
+                size_t size = strlen(args[i]);
+                memcpy(end, args[i], size);
+                end += size;
+            }
+            *end = '\0';
+            handle_history_search(text);
+            free(text);
+        }
+        else
+        {
+            handle_history_command(atoi(args[1]));
+        }
+        return 1;
+    }
+
+    // check if this is a cd command
+    if (strcmp(args[0], "cd") == 0)
+    {
+        handle_cd_command(args); 
+        return 1;
+    }
+
+    // check if this is a ls command
+    if (strcmp(args[0], "ls") == 0)
+    {
+        handle_ls_command(args);
+        return 1;
+    }
+
+    // check if this is a hash command
+    if (strcmp(args[0], "hash") == 0)
+    {
+        handle_hash_command(args);
+        return 1;
+    }
+
+    // check if this is a job control command
+    if (strcmp(args[0], "jobs") == 0)
+    {
+        handle_jobs_command();
+        return 1;
+    }
+    if (strcmp(args[0], "wait") == 0)
+    {
+        handle_wait_command(args);
+        return 1;
+    }
+    if (strcmp(args[0], "fg") == 0)
+    {
+        handle_fg_command(args);
+        return 1;
+    }
+
+    return 0;
+}
+
+// find the executable for args[0]: a full or relative path (contains /) is used as is,
+// anything else is searched in PATH. Returns 0 if there is nothing to execute.
+int resolve_command(const char *command, char *full_path)
+{
+    if (strchr(command, '/') != NULL)
+    {
+        if (access(command, X_OK) != 0)
+        {
+            return 0;
+        }
+        snprintf(full_path, MAX_PATH_LENGTH, "%s", command);
+        return 1;
+    }
+    return find_command_in_path(command, full_path);
+}
+
+// waitpid() for a foreground child, its resource usage goes to line_usage
+void wait_child(pid_t pid, int *status)
+{
+    struct rusage usage;
+    if (wait4(pid, status, 0, &usage) == pid)
+    {
+        add_child_usage(&usage);
+    }
+}
+
+// add the resources of a reaped child to line_usage
+void add_child_usage(const struct rusage *usage)
+{
+    timeradd(&line_usage.ru_utime, &usage->ru_utime, &line_usage.ru_utime);
+    timeradd(&line_usage.ru_stime, &usage->ru_stime, &line_usage.ru_stime);
+    if (usage->ru_maxrss > line_usage.ru_maxrss)
+    {
+        line_usage.ru_maxrss = usage->ru_maxrss;
+    }
+    line_children++;
+}
+
+double timeval_seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// what the profile calls a line: the command of each stage as written, "a | b" for a
+// pipeline. Freed by the caller.
+char *profile_name(const parsed_line *line)
+{
+    if (line->is_parallel)
+    {
+        return strdup("parallel");
+    }
+    size_t length = 1;
+    for (int n = 0; n < line->num_stages; n++)
+    {
+        length += (line->stages[n].words.argc > 0 ? strlen(line->stages[n].words.args[0]) : 0) + 3;
+    }
+    char *name = malloc(length);
+    name[0] = '\0';
+    for (int n = 0; n < line->num_stages; n++)
+    {
+        if (n > 0)
+        {
+            strcat(name, " | ");
+        }
+        if (line->stages[n].words.argc > 0)
+        {
+            strcat(name, line->stages[n].words.args[0]);
+        }
+    }
+    if (line->num_stages <= 0 || name[0] == '\0')
+    {
+        free(name);
+        return strdup(line->num_stages < 0 ? "(invalid pipeline)" : "(empty)");
+    }
+    return name;
+}
+
+// add one run of a command to its profile_table entry
+void record_profile(const char *name, double real, double user, double sys, long maxrss)
+{
+    unsigned int bucket = hash_name(name, strlen(name)) % PROFILE_TABLE_SIZE;
+    profile_entry *entry = profile_table[bucket];
+    while (entry != NULL && strcmp(entry->name, name) != 0)
+    {
+        entry = entry->next;
+    }
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(profile_entry));
+        entry->name = strdup(name);
+        entry->next = profile_table[bucket];
+        profile_table[bucket] = entry;
+    }
+    entry->count++;
+    entry->real += real;
+    entry->user += user;
+    entry->sys += sys;
+    if (maxrss > entry->maxrss)
+    {
+        entry->maxrss = maxrss;
+    }
+}
+
+// qsort: most wall time first
+int compare_profile(const void *a, const void *b)
+{
+    const profile_entry *entry_a = *(const profile_entry **)a;
+    const profile_entry *entry_b = *(const profile_entry **)b;
+    return (entry_a->real < entry_b->real) - (entry_a->real > entry_b->real);
+}
+
+// atexit(): the profile of the batch file on stderr, the commands that took longest first
+void print_profile()
+{
+    if (getpid() != profile_pid)
+    {
+        return; // a child of the shell that ran exit
+    }
+    int count = 0;
+    for (int i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+        for (profile_entry *entry = profile_table[i]; entry != NULL; entry = entry->next)
+        {
+            count++;
+        }
+    }
+    profile_entry **entries = malloc((count + 1) * sizeof(profile_entry *));
+    count = 0;
+    for (int i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+        for (profile_entry *entry = profile_table[i]; entry != NULL; entry = entry->next)
+        {
+            entries[count++] = entry;
+        }
+    }
+    qsort(entries, count, sizeof(profile_entry *), compare_profile);
+
+    fflush(stdout);
+    fprintf(stderr, "%8s %10s %10s %10s %10s  %s\n", "count", "real", "user", "sys", "maxrss", "command");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(stderr, "%8d %9.3fs %9.3fs %9.3fs %8ldKB  %s\n", entries[i]->count, entries[i]->real,
+                entries[i]->user, entries[i]->sys, entries[i]->maxrss, entries[i]->name);
+    }
+    free(entries);
+}
+
+// exit code of a child for last_cmd_rc
+int child_status(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    return 1;
+}
+
+// make room for n more characters in list->text
+void lex_reserve(arg_list *list, size_t n)
+{
+    if (list->text_size + n > list->text_capacity)
+    {
+        list->text_capacity = list->text_capacity == 0 ? 256 : 2 * list->text_capacity;
+        if (list->text_capacity < list->text_size + n)
+        {
+            list->text_capacity = list->text_size + n;
+        }
+        list->text = realloc(list->text, list->text_capacity);
+    }
+}
+
+// add one character of an expanded command to list->text, a space ends the current argument
+void lex_char(arg_list *list, char c, int *in_arg)
+{
+    if (c == ' ' && !*in_arg)
+    {
+        return; // spaces between arguments
+    }
+    lex_reserve(list, 2);
+    if (c == ' ')
+    {
+        list->text[list->text_size++] = '\0';
+        *in_arg = 0;
+        return;
+    }
+    list->text[list->text_size++] = c;
+    if (!*in_arg)
+    {
+        list->argc++;
+        *in_arg = 1;
+    }
+}
+
+// add text to list, expanding variables on the way
+void lex_text(arg_list *list, const char *text, int *in_arg)
+{
+    const char *read_ptr = text;
+    while (*read_ptr)
+    {
+        if (*read_ptr != '$')
+        {
+            lex_char(list, *read_ptr++, in_arg);
+            continue;
+        }
+        read_ptr++;
+        const char *value = variable_reference(&read_ptr);
+        if (value == NULL)
+        {
+            lex_char(list, '$', in_arg); // if not a valid variable name, treat '$' as a literal
+            continue;
+        }
+        while (*value)
+        {
+            lex_char(list, *value++, in_arg);
+        }
+    }
+}
+
+// end the last argument, the text is final now, so point the args into it
+int lex_end(arg_list *list, int *in_arg)
+{
+    lex_char(list, ' ', in_arg);
+    if (list->argc + 1 > list->args_capacity)
+    {
+        list->args_capacity = 2 * (list->argc + 1);
+        list->args = realloc(list->args, list->args_capacity * sizeof(char *));
+    }
+    char *arg = list->text;
+    for (int i = 0; i < list->argc; i++)
+    {
+        list->args[i] = arg;
+        arg += strlen(arg) + 1;
+    }
+    list->args[list->argc] = NULL; // null-terminate the argument list
+    return list->argc;
+}
+
+// split a command (already stripped of comments and redirection) into list->args in one
+// pass, expanding variables on the way: the arguments are copied once, into list->text.
+// A variable with spaces in its value makes several arguments. Returns the number of
+// arguments. The list can be used again for the next command, free_args() releases it.
+int lex_command(const char *command, arg_list *list)
+{
+    list->text_size = 0;
+    list->argc = 0;
+    int in_arg = 0;
+    lex_text(list, command, &in_arg);
+    return lex_end(list, &in_arg);
+}
+
+// the arguments of a parsed command. Without a $ in it these are the words the lexer
+// split it into, only a command with variables goes through the lexer again, into list.
+// A parsed line is run once, so a built-in may change the arguments it gets.
+char **expand_command(parsed_command *cmd, arg_list *list, int *argc)
+{
+    if (!cmd->has_variables)
+    {
+        *argc = cmd->words.argc;
+        return cmd->words.args;
+    }
+    list->text_size = 0;
+    list->argc = 0;
+    int in_arg = 0;
+    for (int i = 0; i < cmd->words.argc; i++)
+    {
+        lex_text(list, cmd->words.args[i], &in_arg);
+        lex_char(list, ' ', &in_arg);
+    }
+    *argc = lex_end(list, &in_arg);
+    return list->args;
+}
+
+void free_args(arg_list *list)
+{
+    free(list->text);
+    free(list->args);
+    *list = (arg_list){0};
+}
+
+// cut length characters of a command (no pipes) into its redirection and words. The
+// lexer copies the words into cmd->words, variables are left for expand_command().
+void parse_command(const char *command, size_t length, parsed_command *cmd)
+{
+    cmd->redirect_type = 0;
+    cmd->filename = NULL;
+    length = parse_redirection(command, length, &cmd->redirect_type, &cmd->filename);
+    cmd->has_variables = memchr(command, '$', length) != NULL;
+
+    cmd->words = (arg_list){0};
+    int in_arg = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        lex_char(&cmd->words, command[i], &in_arg);
+    }
+    lex_end(&cmd->words, &in_arg);
+}
+
+// parse a line (length characters of text, it does not have to be null-terminated) once:
+// comment, &, pipeline stages, redirections and words. run_line() runs it, variables are
+// only expanded then, so their values are the ones at that time.
+void parse_line(const char *text, size_t length, parsed_line *line)
+{
+    *line = (parsed_line){0};
+    line->text = malloc(length + 1);
+    memcpy(line->text, text, length);
+    line->text[length] = '\0';
+    const char *command = line->text;
 
-    // print the sorted filenames
-    for (int i = 0; i < count; i++)
+    // find the comment delimiter '#' 
+    const char *comment_pos = memchr(command, '#', length);
+    if (comment_pos != NULL)
     {
-        printf("%s\n", filenames[i]);
+        length = comment_pos - command; // the command ends at that spot
     }
-    last_cmd_rc = 0;
-    // remember to free
-    for (int i = 0; i < count; i++)
+
+    // time cmd: run_line() reports how long it took
+    size_t spaces = 0;
+    while (spaces < length && command[spaces] == ' ')
     {
-        free(filenames[i]); 
+        spaces++;
+    }
+    if (length - spaces >= 4 && memcmp(command + spaces, "time", 4) == 0 &&
+        (length - spaces == 4 || command[spaces + 4] == ' '))
+    {
+        line->timed = 1;
+        command += spaces + 4;
+        length -= spaces + 4;
     }
-}
 
-// print a specific error message to stderr
-void print_error(const char *message)
-{
-    fprintf(stderr, "%s\n", message);
-}
+    // cmd & runs in the background, built-ins always run in the shell itself
+    if (parse_background(command, &length))
+    {
+        line->job_command = strndup(command, length); // as jobs lists it
+    }
 
-// helper function to check if a line starts with # 
-int is_comment(char *line)
-{
-    // remove leading spaces
-    while (*line == ' ')
+    const char *end = command + length;
+    if (memchr(command, '|', length) == NULL)
     {
-        line++;
+        line->num_stages = 1;
+        line->stages = malloc(sizeof(parsed_command));
+        parse_command(command, length, &line->stages[0]);
+        return;
     }
-    // check if the line starts with '#'
-    return (*line == '#');
-}
 
-// helper function to search for the executable in directories listed in PATH
-int find_command_in_path(const char *command, char *full_path)
-{
-    char *path_env = getenv("PATH");
-    char *path = strdup(path_env); // duplicate the PATH string for manipulation
-    char *saveptr; // for strtok_r
-    char *dir = strtok_r(path, ":", &saveptr); // split PATH by :
+    // cmd1 | cmd2 | ...: every stage needs a command, the line is not run at all otherwise
+    int num_stages = 0;
+    for (const char *stage = command; stage != NULL; )
+    {
+        const char *bar = memchr(stage, '|', end - stage);
+        const char *stage_end = bar != NULL ? bar : end;
+        const char *p = stage;
+        while (p != stage_end && *p == ' ')
+        {
+            p++;
+        }
+        if (p == stage_end || ++num_stages > MAX_PIPE_STAGES)
+        {
+            line->num_stages = -1;
+            return;
+        }
+        stage = bar ? bar + 1 : NULL;
+    }
 
-    // try each directory in PATH
-    while (dir != NULL)
+    line->num_stages = num_stages;
+    line->stages = malloc(num_stages * sizeof(parsed_command));
+    const char *stage = command;
+    for (int n = 0; n < num_stages; n++)
     {
-        snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", dir, command);
-        if (access(full_path, X_OK) == 0)
+        const char *bar = memchr(stage, '|', end - stage);
+        size_t stage_length = (bar != NULL ? bar : end) - stage;
+        // "cmd <in | ..." leaves a space after the file name
+        while (stage_length > 0 && stage[stage_length - 1] == ' ')
         {
-            free(path);
-            return 1; // found the command and it's executable
+            stage_length--;
         }
-        dir = strtok_r(NULL, ":", &saveptr);
+        parse_command(stage, stage_length, &line->stages[n]);
+        stage = bar + 1;
     }
+}
 
-    free(path);
-    return 0; // command not found in any PATH directory
+void free_line(parsed_line *line)
+{
+    for (int n = 0; n < line->num_stages; n++)
+    {
+        free_args(&line->stages[n].words);
+        free(line->stages[n].filename);
+    }
+    for (int i = 0; i < line->block_size; i++)
+    {
+        free_line(&line->block[i]);
+    }
+    free(line->stages);
+    free(line->block);
+    free(line->text);
+    free(line->job_command);
 }
 
-// check if a command is a built-in command
-int is_builtin_command(const char *cmd)
+// run a parsed line, the way execute_command() runs a command. A line that starts with
+// time, or any line when profiling, is measured: wall time, the CPU time of the shell and
+// of the children it waited for, and their largest max RSS.
+void run_line(parsed_line *line)
 {
-    // extract the first token to compare
-    char cmd_copy[MAX_COMMAND_LENGTH];
-    snprintf(cmd_copy, sizeof(cmd_copy), "%s", cmd);
-    char *token = strtok(cmd_copy, " ");
+    int timed = line->timed || profiling;
+    struct timespec start;
+    struct rusage self_start;
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &self_start);
+        memset(&line_usage, 0, sizeof(line_usage));
+        line_children = 0;
+    }
 
-    if (token == NULL)
+    if (line->is_parallel)
     {
-        return 0;
+        execute_parallel(line);
+    }
+    else
+    {
+        execute_line(line);
     }
 
-    return strcmp(token, "exit") == 0 || strcmp(token, "cd") == 0 || strcmp(token, "ls") == 0 ||
-           strcmp(token, "local") == 0 || strcmp(token, "export") == 0 || strcmp(token, "vars") == 0 ||
-           strcmp(token, "history") == 0;
+    if (timed)
+    {
+        struct timespec end;
+        struct rusage self_end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &self_end);
+        double real = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        double user = timeval_seconds(line_usage.ru_utime) +
+                      timeval_seconds(self_end.ru_utime) - timeval_seconds(self_start.ru_utime);
+        double sys = timeval_seconds(line_usage.ru_stime) +
+                     timeval_seconds(self_end.ru_stime) - timeval_seconds(self_start.ru_stime);
+        // built-ins run in the shell, its own peak is what they used
+        long maxrss = line_children > 0 ? line_usage.ru_maxrss : self_end.ru_maxrss;
+        if (line->timed)
+        {
+            fprintf(stderr, "real %.3fs user %.3fs sys %.3fs maxrss %ldKB\n", real, user, sys, maxrss);
+        }
+        if (profiling)
+        {
+            char *name = profile_name(line);
+            record_profile(name, real, user, sys, maxrss);
+            free(name);
+        }
+    }
 }
 
-// execute a command using execv 
-void execute_command(char *command)
+// run the commands of a line
+void execute_line(parsed_line *line)
 {
     // if not built-in, add command to history 
-    if (!is_builtin_command(command))
+    if (!is_builtin_command(line->text))
     {
-        insert_history(command);
+        insert_history(line->text);
     }
 
-    char *args[MAX_ARGS];
-    int i = 0;
-    char *token;
-    int redirect_type = 0;
-    char *filename = NULL;
-
-    // find the comment delimiter '#' 
-    char *comment_pos = strchr(command, '#');
-    if (comment_pos != NULL)
+    if (line->num_stages < 0)
     {
-        *comment_pos = '\0'; // truncate the command at that spot
+        fprintf(stderr, "Error: Invalid pipeline\n");
+        last_cmd_rc = 1;
     }
-
-    // parse redirection operators and filenames
-    parse_redirection(command, &redirect_type, &filename);
-
-    // expand variables
-    expand_variables(command);
-
-    // tokenize the command into arguments
-    token = strtok(command, " ");
-    while (token != NULL && i < MAX_ARGS - 1)
+    else if (line->num_stages > 1)
     {
-        args[i++] = token; // regular command/argument
-        token = strtok(NULL, " ");
+        execute_pipeline(line);
     }
-    args[i] = NULL; // null-terminate the argument list
-
-    // if no command, return without doing anything
-    if (i == 0)
+    else
     {
-        last_cmd_rc = 0;
-        return;
+        execute_simple_command(&line->stages[0], line->job_command);
     }
+}
 
-    // check if this is the exit command
-    if (strcmp(args[0], "exit") == 0)
+// run cmd1 | cmd2 | ... | cmdN: every stage is forked right away, connected to the next
+// one by a pipe, so data streams between them. Each stage can have its own redirection,
+// which wins over the pipe. last_cmd_rc is the exit code of the last stage.
+// A line with a job_command runs in the background, as a job instead of being waited for.
+void execute_pipeline(parsed_line *line)
+{
+    pid_t pids[MAX_PIPE_STAGES];
+    pid_t pgid = line->job_command != NULL && job_control ? 0 : -1; // every stage joins the first one's group
+    int num_stages = line->num_stages;
+    int prev_read = -1; // read end of the pipe from the previous stage
+
+    // children must not write out what is still buffered in the shell
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int n = 0; n < num_stages; n++)
     {
-        if (args[1] != NULL)
+        int redirect_type = line->stages[n].redirect_type;
+        char *filename = line->stages[n].filename;
+        int num_args;
+        char **args = expand_command(&line->stages[n], &command_args, &num_args);
+
+        char full_path[MAX_PATH_LENGTH];
+        int found = num_args > 0 && !is_builtin_command(args[0]) && resolve_command(args[0], full_path);
+
+        int fds[2] = {-1, -1};
+        if (n < num_stages - 1 && pipe2(fds, O_CLOEXEC) < 0)
         {
-            fprintf(stderr, "Error: exit does not take any arguments\n");
-            last_cmd_rc = 255; 
+            print_error("Pipe failed");
+            num_stages = n;
+            break;
         }
-        else
+
+        if (found)
         {
-            exit(last_cmd_rc);
+            // external commands are spawned, only built-ins and errors need a fork
+            int redirect_fd;
+            pids[n] = -1;
+            if (open_redirection(redirect_type, filename, &redirect_fd))
+            {
+                pids[n] = spawn_command(full_path, args, prev_read, fds[1], redirect_type, redirect_fd, pgid);
+                if (pids[n] < 0)
+                {
+                    fprintf(stderr, "Command execution failed\n");
+                }
+            }
+            if (redirect_fd != -1)
+            {
+                close(redirect_fd);
+            }
+        }
+        else if ((pids[n] = fork()) < 0)
+        {
+            print_error("Fork failed");
+            if (fds[0] != -1)
+            {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            num_stages = n;
+            break;
+        }
+        else if (pids[n] == 0)
+        {
+            // child process: read from the previous stage, write to the next one
+            if (pgid != -1)
+            {
+                setpgid(0, pgid);
+            }
+            if (prev_read != -1)
+            {
+                dup2(prev_read, STDIN_FILENO);
+                close(prev_read);
+            }
+            if (fds[1] != -1)
+            {
+                close(fds[0]);
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[1]);
+            }
+            if (redirect_type > 0 && filename != NULL)
+            {
+                handle_redirection(redirect_type, filename);
+            }
+            // _exit(): exit() would also move the offset of a batch file shared with the shell
+            if (num_args == 0 || strcmp(args[0], "exit") == 0)
+            {
+                _exit(0);
+            }
+            if (execute_builtin(args))
+            {
+                fflush(stdout);
+                fflush(stderr);
+                _exit(last_cmd_rc);
+            }
+            _exit(255); // Command not found
         }
-        return;
-    }
 
-    // check if this is a local commadn
-    if (strcmp(args[0], "local") == 0 && args[1] != NULL)
-    {
-        handle_local_command(args[1]); 
-        return;
+        // parent process: keep only the read end for the next stage
+        if (pgid != -1 && pids[n] > 0)
+        {
+            setpgid(pids[n], pgid); // the child may not have done it yet
+            pgid = pgid == 0 ? pids[n] : pgid;
+        }
+        if (prev_read != -1)
+        {
+            close(prev_read);
+        }
+        if (fds[1] != -1)
+        {
+            close(fds[1]);
+        }
+        prev_read = fds[0];
     }
-
-    // check if this is an export command
-    if (strcmp(args[0], "export") == 0 && args[1] != NULL)
+    if (prev_read != -1)
     {
-        handle_export_command(args[1]);
-        return;
+        close(prev_read);
     }
 
-    // check if this is the vars command
-    if (strcmp(args[0], "vars") == 0)
+    if (line->job_command != NULL && add_job(pids, num_stages, pgid, line->job_command))
     {
-        handle_vars_command();
+        last_cmd_rc = 0;
         return;
     }
 
-    // check if this is a history command
-    if (strcmp(args[0], "history") == 0)
+    // wait for every stage, the last one decides the exit code
+    last_cmd_rc = 1;
+    for (int n = 0; n < num_stages; n++)
     {
-        if (args[1] == NULL)
-        {
-            print_history();
-        }
-        else if (strcmp(args[1], "set") == 0 && args[2] != NULL)
+        int status;
+        if (pids[n] < 0)
         {
-            set_history_size(atoi(args[2]));
+            continue; // it could not be started
         }
-        else
+        wait_child(pids[n], &status);
+        if (n == num_stages - 1)
         {
-            handle_history_command(atoi(args[1]));
+            last_cmd_rc = child_status(status);
         }
-        return;
     }
+}
 
-    // check if this is a cd command
-    if (strcmp(args[0], "cd") == 0)
+// parallel N { ... }: run the lines of the block with at most N at a time.
+// Each one runs in its own copy of the shell with stdout and stderr going to temporary
+// files, which are copied out in script order, so the output reads as if the block ran
+// serially. last_cmd_rc is 0 if all succeeded, the exit code of the first failure otherwise.
+void execute_parallel(parsed_line *block)
+{
+    // the header is "parallel N {"
+    int num_args = lex_command(block->text, &command_args);
+    char **args = command_args.args;
+    long max_running = num_args == 3 && strcmp(args[2], "{") == 0 ? strtol(args[1], NULL, 10) : 0;
+    if (max_running > MAX_PARALLEL)
     {
-        handle_cd_command(args); 
+        max_running = MAX_PARALLEL; // strtol() stops at LONG_MAX for longer numbers
+    }
+    if (!block->block_closed || max_running <= 0)
+    {
+        fprintf(stderr, "Error: Invalid parallel block\n");
+        last_cmd_rc = 1;
         return;
     }
 
-    // check if this is a ls command
-    if (strcmp(args[0], "ls") == 0)
+    int count = block->block_size;
+    parallel_cmd *cmds = calloc(count, sizeof(parallel_cmd));
+    for (int i = 0; i < count; i++)
     {
-        handle_ls_command(); 
-        return;
+        cmds[i].line = &block->block[i];
+        if (!is_builtin_command(cmds[i].line->text))
+        {
+            insert_history(cmds[i].line->text); // the copy of the shell running it keeps its own history
+        }
     }
 
-    // check if this is a full or relative path (contains /)
-    if (strchr(args[0], '/') != NULL)
+    // children must not write out what is still buffered in the shell
+    fflush(stdout);
+    fflush(stderr);
+    last_cmd_rc = 0;
+
+    sigset_t old;
+    block_sigchld(&old);
+    int started = 0;
+    int running = 0;
+    int printed = 0;
+    while (printed < count)
     {
-        if (access(args[0], X_OK) == 0)
+        while (started < count && running < max_running)
         {
-            pid_t pid = fork();
-            if (pid < 0)
+            parallel_cmd *cmd = &cmds[started++];
+            cmd->out = tmpfile();
+            cmd->err = tmpfile();
+            if (cmd->out == NULL || cmd->err == NULL || (cmd->pid = fork()) < 0)
             {
                 print_error("Fork failed");
-                last_cmd_rc = 1;
-                return;
+                cmd->pid = -1;
+                cmd->rc = 1;
+                continue;
             }
-            else if (pid == 0)
+            if (cmd->pid == 0)
             {
-                // child process: execute the command
-                if (redirect_type > 0 && filename != NULL)
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                // the shell wrote the block to the history file
+                if (history_file.fd != -1)
                 {
-                    handle_redirection(redirect_type, filename);
+                    close(history_file.fd);
+                    history_file.fd = -1;
                 }
-                execv(args[0], args);
-                // if execv returns, there was an error
-                fprintf(stderr, "Command execution failed\n");
-                exit(1);
+                history_file.path = NULL;
+                dup2(fileno(cmd->out), STDOUT_FILENO);
+                dup2(fileno(cmd->err), STDERR_FILENO);
+                run_line(cmd->line);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(last_cmd_rc);
             }
-            else
+            running++;
+        }
+
+        // collect what is done, nothing finishes unnoticed while SIGCHLD is blocked
+        int reaped = 0;
+        for (int i = printed; i < started; i++)
+        {
+            int status;
+            struct rusage usage;
+            if (cmds[i].pid > 0 && wait4(cmds[i].pid, &status, WNOHANG, &usage) == cmds[i].pid)
             {
-                // parent process: wait for the child to finish
-                int status;
-                waitpid(pid, &status, 0);
+                add_child_usage(&usage);
+                cmds[i].pid = -1;
+                cmds[i].rc = child_status(status);
+                running--;
+                reaped = 1;
+            }
+        }
 
-                if (WIFEXITED(status))
-                {
-                    last_cmd_rc = WEXITSTATUS(status);
-                }
-                else
-                {
-                    last_cmd_rc = 1;
-                }
+        // the output of a command goes out once everything before it is out
+        while (printed < started && cmds[printed].pid < 0)
+        {
+            parallel_cmd *cmd = &cmds[printed++];
+            if (cmd->out != NULL)
+            {
+                copy_output(fileno(cmd->out), STDOUT_FILENO);
+                fclose(cmd->out);
+            }
+            if (cmd->err != NULL)
+            {
+                copy_output(fileno(cmd->err), STDERR_FILENO);
+                fclose(cmd->err);
+            }
+            if (cmd->rc != 0 && last_cmd_rc == 0)
+            {
+                last_cmd_rc = cmd->rc;
             }
         }
-        else
+        if (!reaped && running > 0)
+        {
+            sigsuspend(&old);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    free(cmds);
+}
+
+// write everything in a temporary file (from the start) to fd. sendfile() copies it in
+// the kernel, read() and write() are left for what it cannot do (an O_APPEND file).
+void copy_output(int from, int to)
+{
+    struct stat st;
+    off_t offset = 0;
+    if (fstat(from, &st) == 0)
+    {
+        while (offset < st.st_size && sendfile(to, from, &offset, st.st_size - offset) > 0)
+        {
+        }
+        if (offset == st.st_size)
         {
-            last_cmd_rc = 255; // Command not found
+            return;
+        }
+    }
+
+    char buffer[65536];
+    ssize_t n;
+    lseek(from, offset, SEEK_SET);
+    while ((n = read(from, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t done = 0; done < n; )
+        {
+            ssize_t written = write(to, buffer + done, n - done);
+            if (written <= 0)
+            {
+                return;
+            }
+            done += written;
         }
+    }
+}
+
+// execute a command using execv 
+void execute_command(char *command)
+{
+    parsed_line line;
+    parse_line(command, strlen(command), &line);
+    run_line(&line);
+    free_line(&line);
+}
+
+// run a command without pipes, in the background if there is a job_command
+void execute_simple_command(parsed_command *cmd, const char *job_command)
+{
+    int redirect_type = cmd->redirect_type;
+    char *filename = cmd->filename;
+
+    // expand variables into the arguments
+    // if no command, return without doing anything
+    int num_args;
+    char **args = expand_command(cmd, &command_args, &num_args);
+    if (num_args == 0)
+    {
+        last_cmd_rc = 0;
         return;
     }
 
+    if (is_builtin_command(args[0]))
+    {
+        // built-ins run in the shell, their output goes to the redirection while they run
+        int redirect_fd;
+        if (!open_redirection(redirect_type, filename, &redirect_fd))
+        {
+            last_cmd_rc = 1;
+            return;
+        }
+        int saved[2];
+        apply_redirection(redirect_type, redirect_fd, saved);
+        int handled = execute_builtin(args);
+        restore_redirection(redirect_type, saved);
+        if (handled)
+        {
+            return;
+        }
+    }
+
     // construct the full path for the command
     char full_path[MAX_PATH_LENGTH];
-    if (!find_command_in_path(args[0], full_path))
+    if (!resolve_command(args[0], full_path))
     {
         last_cmd_rc = 255; // Command not found
         return;
     }
 
-    // Fork and execute the command
-    pid_t pid = fork();
-    if (pid < 0)
+    // the shell opens the redirection, the command gets it as its stdin/stdout/stderr
+    int redirect_fd;
+    if (!open_redirection(redirect_type, filename, &redirect_fd))
     {
-        print_error("Fork failed");
         last_cmd_rc = 1;
         return;
     }
-    else if (pid == 0)
+    // what built-ins printed comes first
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = spawn_command(full_path, args, -1, -1, redirect_type, redirect_fd,
+                              job_command != NULL && job_control ? 0 : -1);
+    if (redirect_fd != -1)
+    {
+        close(redirect_fd);
+    }
+    if (pid < 0)
     {
-        // Child process: execute the command
-        if (redirect_type > 0 && filename != NULL)
-        {
-            handle_redirection(redirect_type, filename);
-        }
-        execv(full_path, args);
-        // If execv returns, there was an error
         fprintf(stderr, "Command execution failed\n");
-        exit(1);
+        last_cmd_rc = 1;
+        return;
     }
-    else
+    if (job_command != NULL && add_job(&pid, 1, job_control ? pid : -1, job_command))
     {
-        // Parent process: wait for the child to finish
-        int status;
-        waitpid(pid, &status, 0);
-
-        if (WIFEXITED(status))
-        {
-            last_cmd_rc = WEXITSTATUS(status);
-        }
-        else
-        {
-            last_cmd_rc = 1;
-        }
+        last_cmd_rc = 0;
+        return;
     }
+
+    // wait for the command to finish
+    int status;
+    wait_child(pid, &status);
+    last_cmd_rc = child_status(status);
 }
 
 int main(int argc, char *argv[])
 {
     init_path();
+    init_env_vars();
     init_history();
+    init_history_file(argc == 1 && isatty(STDIN_FILENO));
+    load_history_file();
+    init_jobs();
+
+    // built-in output goes out in large blocks, the shell flushes it before a command
+    // writes to the same file
+    if (!isatty(STDOUT_FILENO))
+    {
+        setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+    }
 
     if (argc > 2)
     {
@@ -861,5 +2751,6 @@ int main(int argc, char *argv[])
         interactive_mode();
     }
 
+    free_args(&command_args);
     return last_cmd_rc;
 }
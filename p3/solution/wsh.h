@@ -9,23 +9,44 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <dirent.h> 
+#include <sys/types.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+extern char **environ;  // passed on to spawned commands
 
-#define MAX_VARS 100  // maximum number of shell variables
-#define MAX_VAR_LENGTH 100  // maximum length of a shell variable
-#define MAX_COMMAND_LENGTH 1024
-#define MAX_ARGS 64
 #define DEFAULT_HISTORY_SIZE 5
 #define MAX_PATH_LENGTH 1024
+#define MAX_PIPE_STAGES 64 // most commands in one pipeline
+#define PATH_CACHE_SIZE 64 // buckets in the command hash table
+#define MAX_JOBS 32 // background jobs tracked at once
+#define MAX_PARALLEL 64 // most commands running at once in a parallel block
+#define PROFILE_TABLE_SIZE 64 // buckets of the per-command profile
+#define STDOUT_BUFFER_SIZE (1 << 16) // stdout buffer when it is not a terminal
+#define LS_BUFFER_SIZE (1 << 20) // bytes of directory entries read at once
+#define HISTORY_BLOCK 64 // history file entries under one search signature
+#define HISTORY_BITS_LOG2 12
+#define HISTORY_BITS (1 << HISTORY_BITS_LOG2) // trigram buckets in a search signature
 
 // struct to store shell variables
 typedef struct {
-    char name[MAX_VAR_LENGTH];
-    char value[MAX_VAR_LENGTH];
+    char *name;
+    char *value;
+    unsigned int hash;  // hash_name() of name
 } ShellVar;
 
+// variables in the order they were set, with an open addressing index by name
+typedef struct {
+    ShellVar *vars;
+    int count;
+    int capacity;
+    int *index;  // position in vars + 1, 0 for an empty slot
+    int index_size;  // a power of two, at least twice count
+} var_table;
+
 // global variables and functions for handling shell variables
-extern ShellVar shell_vars[MAX_VARS];
-extern int num_vars;
+extern var_table shell_vars;  // local
+extern var_table env_vars;  // the environment, kept up to date by export
 
 // struct to handle history functionality
 typedef struct {
@@ -36,8 +57,115 @@ typedef struct {
     int end;
 } history_t;
 
+// a command resolved through PATH, chained in its path_cache bucket
+typedef struct path_entry {
+    char *command;
+    char *path;
+    int hits;  // times it was used from the cache
+    struct path_entry *next;
+} path_entry;
+
+// command hash table: command name -> full path, cleared when PATH changes
+extern path_entry *path_cache[PATH_CACHE_SIZE];
+
+// a command started with &, its processes are reaped by the SIGCHLD handler
+typedef struct {
+    int id;  // [n] in jobs, 0 if the slot is free
+    int order;  // when it was started, fg picks the latest
+    pid_t pgid;  // its own process group in interactive mode, -1 otherwise
+    pid_t pids[MAX_PIPE_STAGES];  // 0 once reaped, -1 if it did not start
+    int num_pids;
+    volatile sig_atomic_t running;  // processes not reaped yet
+    volatile sig_atomic_t rc;  // exit code of the last process
+    char *command;
+} job_t;
+
+// background jobs, job n is in jobs[n - 1]
+extern job_t jobs[MAX_JOBS];
+extern int job_control;  // background jobs get a process group and fg the terminal
+
+// the arguments of one command, all of them in a single buffer
+typedef struct {
+    char *text;  // the arguments one after the other, each ending in \0
+    size_t text_size;
+    size_t text_capacity;
+    char **args;  // pointers into text, args[argc] is NULL like execv() wants it
+    int argc;
+    int args_capacity;
+} arg_list;
+
+// a command without pipes, parsed once: its redirection and its words as written
+typedef struct {
+    int redirect_type;
+    char *filename;
+    arg_list words;  // split at spaces, variables are expanded when it runs
+    int has_variables;  // a $ in the words
+} parsed_command;
+
+// a line parsed once by parse_line(), run by run_line()
+typedef struct parsed_line {
+    char *text;  // as written, for history
+    char *job_command;  // set if it ends in &, as jobs lists it
+    int timed;  // it started with time
+    int num_stages;  // -1 for an invalid pipeline
+    parsed_command *stages;
+    // parallel N { ... } in a batch file, text is the header
+    int is_parallel;
+    struct parsed_line *block;
+    int block_size;
+    int block_closed;  // the block ended with }
+} parsed_line;
+
+// a command of a parallel block, its output is kept until the ones before it are done
+typedef struct {
+    parsed_line *line;
+    pid_t pid;  // 0 until started, -1 once reaped or if it did not start
+    FILE *out;  // its stdout
+    FILE *err;  // its stderr
+    int rc;
+} parallel_cmd;
+
+extern arg_list command_args;  // reused by every command
+extern const char *builtin_commands[];  // NULL-terminated
+
+// the trigrams that appear somewhere in a block of HISTORY_BLOCK history file entries
+typedef struct {
+    unsigned long long bits[HISTORY_BITS / 64];
+} history_block;
+
+// persistent history: an append-only file shared by every session, one command per line
+typedef struct {
+    char *path;  // NULL if there is none
+    int fd;  // opened on first use, -1 before
+    char *data;  // the file mapped by the last search, size bytes
+    size_t size;
+    size_t indexed;  // where the first entry that is not indexed yet starts
+    size_t *entries;  // offset of each entry
+    int count;
+    int capacity;
+    history_block *blocks;  // one for every HISTORY_BLOCK entries
+} history_file_t;
+
+// what the commands with the same name took in total, with WSH_PROFILE set
+typedef struct profile_entry {
+    char *name;  // see profile_name()
+    int count;
+    double real;  // seconds
+    double user;
+    double sys;
+    long maxrss;  // KB, the largest of any run
+    struct profile_entry *next;
+} profile_entry;
+
+extern int profiling;
+extern pid_t profile_pid;  // the shell, not a child of it that calls exit()
+extern profile_entry *profile_table[PROFILE_TABLE_SIZE];
+extern struct rusage line_usage;  // children reaped while the current line ran
+extern int line_children;
+
 // global history object
 extern history_t history;  
+extern history_file_t history_file;
 extern int last_command_status;  // Store the status of the last executed command
 
 // init path
@@ -46,28 +174,80 @@ void init_path();
 // shell modes
 void interactive_mode();
 void batch_mode(const char* batch_file);
+char* load_batch_file(int fd, size_t* size, int* mapped);  // mmap() or read() all of it
+int is_parallel_header(const char* command, size_t length);  // "parallel N {" with N > 0
+
+// parsing, once per line
+void parse_line(const char* text, size_t length, parsed_line* line);
+void parse_command(const char* command, size_t length, parsed_command* cmd);
+void run_line(parsed_line* line);  // timed if it asks for it or when profiling
+void execute_line(parsed_line* line);
+void free_line(parsed_line* line);
 
 // command execution
 void execute_command(char* command);
+void execute_simple_command(parsed_command* cmd, const char* job_command);  // no pipes
+void execute_pipeline(parsed_line* line);  // cmd1 | cmd2 | ... | cmdN
+void execute_parallel(parsed_line* block);  // parallel N { ... } in a batch file
+void copy_output(int from, int to);  // a temporary file to stdout/stderr
+int execute_builtin(char *args[]);  // run a built-in command, 0 if args[0] is not one
+int lex_command(const char* command, arg_list* list);  // expand variables and split into args
+char **expand_command(parsed_command* cmd, arg_list* list, int* argc);  // args of a parsed command
+void lex_reserve(arg_list* list, size_t n);
+void lex_char(arg_list* list, char c, int* in_arg);
+void lex_text(arg_list* list, const char* text, int* in_arg);
+int lex_end(arg_list* list, int* in_arg);
+void free_args(arg_list* list);
+int resolve_command(const char* command, char* full_path);  // path of the executable to run
+int child_status(int status);  // exit code of a child for last_cmd_rc
+void wait_child(pid_t pid, int* status);  // wait4() a foreground child
+
+// time and WSH_PROFILE
+void add_child_usage(const struct rusage* usage);
+double timeval_seconds(struct timeval tv);
+char* profile_name(const parsed_line* line);
+void record_profile(const char* name, double real, double user, double sys, long maxrss);
+int compare_profile(const void* a, const void* b);
+void print_profile();
 
 // redirection
 void handle_redirection(int redirect_type, char* filename);
-void parse_redirection(char* command, int* redirect_type, char** filename); // set up redirection type
+int open_redirection(int redirect_type, char* filename, int* fd);  // open the file in the shell
+void redirection_targets(int redirect_type, int* first, int* second);  // the fds it replaces
+void apply_redirection(int redirect_type, int redirect_fd, int saved[2]);  // for a built-in
+void restore_redirection(int redirect_type, int saved[2]);
+pid_t spawn_command(const char* full_path, char *args[], int in_fd, int out_fd, int redirect_type, int redirect_fd,
+                    pid_t pgid);
+size_t parse_redirection(const char* command, size_t length, int* redirect_type, char** filename); // set up redirection type
 
 // env and shell variable handling
+unsigned int hash_name(const char* name, size_t length);
+ShellVar* find_var(var_table* table, const char* name, size_t length);  // name need not end in \0
+void put_var(var_table* table, const char* name, const char* value);
+void init_env_vars();
 const char* get_shell_var(const char* varname);
 void set_shell_var(const char* varname, const char* value);
 void handle_local_command(char* command);
-void expand_variables(char* command);
+const char* variable_reference(const char** read_ptr);  // the value of $name at *read_ptr
+char* expand_variables(const char* command);  // a new string, freed by the caller
 void handle_export_command(char* command);
 void handle_vars_command();
 
 // history-related functions
 void init_history();
 void insert_history(const char* cmd);
+int add_history(const char* command, size_t length);  // buffer only, 0 for a repeat
 void print_history();  // Print the stored history
 void handle_history_command(int n);
 void set_history_size(int new_size);
+void init_history_file(int interactive);
+void load_history_file();  // the last entries of the file into the history buffer
+int open_history_file();
+void append_history_file(const char* command);  // locked, for concurrent sessions
+unsigned int history_trigram(const char* text);
+size_t history_entry_length(int i);
+int refresh_history_index();
+void handle_history_search(const char* text);  // history search text
 
 // Built-in command handlers
 // all built-in implemented
@@ -77,9 +257,34 @@ void set_history_size(int new_size);
 // 4. local -> see handle_local_command
 // 5. vars -> see handle_vars_command
 // 6. history -> see handle_history)command
-// 7. ls
+// 7. ls -> see handle_ls_command, ls -U does not sort
+// 8. hash -> see handle_hash_command
+// 9. jobs, wait, fg -> see handle_jobs_command, handle_wait_command, handle_fg_command
 void handle_cd_command(char *args[]);
-void handle_ls_command();
+void handle_ls_command(char *args[]);
+void radix_sort_names(char **names, char **scratch, int count, size_t depth);
+void write_output(const char* buffer, size_t size);  // one write() to stdout
+void handle_hash_command(char *args[]);
+void handle_jobs_command();
+void handle_wait_command(char *args[]);
+void handle_fg_command(char *args[]);
+
+// background jobs
+int parse_background(const char* command, size_t* length);  // strip a trailing &, 1 if there was one
+void init_jobs();
+void reap_jobs(int sig);  // SIGCHLD handler
+void block_sigchld(sigset_t* old);
+int add_job(pid_t pids[], int num_pids, pid_t pgid, const char* command);
+job_t* find_job(const char* spec);
+void wait_for_job(job_t* job);
+void give_terminal(pid_t pgid);
+void report_done_jobs();  // before the prompt
+
+// command hash table
+unsigned int hash_command(const char* command);
+int lookup_path_cache(const char* command, char* full_path);
+void insert_path_cache(const char* command, const char* full_path);
+void clear_path_cache();
 
 // helper functions
 void print_error(const char* message);  // print error message to stderr